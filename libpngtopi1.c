@@ -0,0 +1,3242 @@
+/**
+ * @file    libpngtopi1.c
+ * @author  Benjamin Gerard <https://sourceforge.net/u/benjihan>
+ * @date    2017-05-31
+ * @brief   png to p[ci]1/2/3 (and reverse) in memory conversion library.
+ */
+
+/*
+  ----------------------------------------------------------------------
+
+  pngtopi1 - a simple png to p[ci]1/2/3 image converter (and reverse)
+  Copyright (C) 2018-2023 Benjamin Gerard
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  ----------------------------------------------------------------------
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#else
+
+# if !defined(DEBUG) && !defined(NDEBUG)
+#  define NDEBUG 1
+# endif
+
+# ifndef FMT23
+#  ifdef __GNUC__     /* /GB: Should test against the exact version */
+#    define FMT23 __attribute__ ((format (printf, 2, 3)))
+#  endif
+# endif
+
+#define _GNU_SOURCE 1
+
+#endif /* HAVE_CONFIG_H */
+
+/* ---------------------------------------------------------------------- */
+
+
+/* std */
+#include <assert.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+
+#ifdef __MINGW32__
+#include <libgen.h> /* GB: mingw does not have basename() in string.h  */
+#else
+#include <unistd.h>			/* sysconf() */
+#endif
+
+/* libpng */
+#include <zlib.h>
+#include <png.h>
+
+/* SIMD */
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "pngtopi1.h"
+
+/* ---------------------------------------------------------------------- */
+
+/* Error codes */
+enum {
+  E_OK  = PNGTOPI1_E_OK,
+  E_ERR = PNGTOPI1_E_ERR,
+  E_ARG = PNGTOPI1_E_ARG,
+  E_INT = PNGTOPI1_E_INT,
+  E_INP = PNGTOPI1_E_INP,
+  E_OUT = PNGTOPI1_E_OUT,
+  E_PNG = PNGTOPI1_E_PNG
+};
+
+/* Image types */
+enum {
+  PXX = PNGTOPI1_PXX, PIX = PNGTOPI1_PIX,
+  PCX = PNGTOPI1_PCX, PNG = PNGTOPI1_PNG
+};
+
+static const char type_names[][4] = {
+  "P??","PI?","PC?","PNG"
+};
+
+/* PNG compression presets (--png-speed) */
+enum {
+  PZ_DEFAULT = PNGTOPI1_PZ_DEFAULT,
+  PZ_FAST    = PNGTOPI1_PZ_FAST,
+  PZ_SMALL   = PNGTOPI1_PZ_SMALL,
+  PZ_MAX     = PNGTOPI1_PZ_MAX
+};
+
+/* PNG writers (--png-writer) */
+enum {
+  PW_LIBPNG = PNGTOPI1_PW_LIBPNG,
+  PW_ZLIB   = PNGTOPI1_PW_ZLIB,
+  PW_FIXED  = PNGTOPI1_PW_FIXED,
+  PW_STORED = PNGTOPI1_PW_STORED
+};
+
+/* RGB conversion methods (bit-field) */
+enum {
+  CQ_TBD = 0,		       /* ..00 | To be determined           */
+  CQ_STF = PNGTOPI1_CQ_STF,    /* ..01 | Using 3 bits per component */
+  CQ_STE = PNGTOPI1_CQ_STE,    /* ..10 | Using 4 bits per component */
+
+  CQ_000 = PNGTOPI1_CQ_000,    /* 01.. | 0 fill                     */
+  CQ_LBR = PNGTOPI1_CQ_LBR,    /* 10.. | Left bit replication       */
+  CQ_FDR = PNGTOPI1_CQ_FDR     /* 11.. | Full dynamic range         */
+};
+
+/* Degas magic word */
+enum {
+  DEGAS_PI1 = 0x0000,
+  DEGAS_PI2 = 0x0001,
+  DEGAS_PI3 = 0x0002,
+  DEGAS_PC1 = DEGAS_PI1+0x8000,
+  DEGAS_PC2 = DEGAS_PI2+0x8000,
+  DEGAS_PC3 = DEGAS_PI3+0x8000
+};
+
+typedef unsigned int uint_t;
+
+/* Input bytes read by libpng */
+typedef struct myin_s myin_t;
+struct myin_s {
+  const uint8_t * data;
+  size_t len, pos;
+};
+
+#define IMG_COMMON				\
+  int8_t magic[4];				\
+  const char * path;				\
+  int	 type, w, h, d, c
+
+typedef struct mypng_s mypng_t;
+struct mypng_s {
+  IMG_COMMON;
+
+  int i, t, f, z, p;
+  int	      err;			/* reading a row failed */
+  myin_t      in;			/* read until rows are read */
+  png_structp png;
+  png_colorp  lut;
+  int	      lutsz;
+  png_infop   inf;
+  png_bytep  *rows;
+  void       *arena;			/* rows pointers and rows buffer */
+};
+
+typedef struct mypix_s mypix_t;
+struct mypix_s {
+  IMG_COMMON;
+  uint8_t bits[32034];		 /* uncompressed (include header)  */
+};
+
+typedef union myimg_s myimg_t;
+union myimg_s {
+  mypix_t pix;
+  mypng_t png;
+};
+
+typedef struct colorcount_s colcnt_t;
+struct colorcount_s {
+  uint32_t rgb:12, cnt:20;		/* Is it legal ? */
+};
+
+static const struct degasfmt_s {
+  const char name[4];
+  unsigned short  id, minsz,   w,  h, d, c,rle;
+} degas[6] = {
+  { "PI1", DEGAS_PI1, 32034, 320,200, 2,16, 0 },
+  { "PC1", DEGAS_PC1, 1634 , 320,200, 2,16, 1 },
+  { "PI2", DEGAS_PI2, 32034, 640,200, 1,4,  0 },
+  { "PC2", DEGAS_PC2, 839  , 640,200, 1,4,  1 },
+  { "PI3", DEGAS_PI3, 32034, 640,400, 0,0,  0 },
+  { "PC3", DEGAS_PC3, 854  , 640,400, 0,0,  1 },
+};
+
+
+/* ----------------------------------------------------------------------
+ *  Message functions
+ *
+ *  Messages go to the message function of the context options. The
+ *  first error is also kept in the conversion output.
+ **/
+
+#ifndef FMT23
+#define FMT23
+#endif
+
+static void vmsg(const pngtopi1_ctx * ctx, int level,
+		 const char * fmt, va_list list)
+{
+  static const int8_t min[] = { -1, 0, 0, 1, 2 };
+  char s[512];
+  int n;
+
+  if (level == PNGTOPI1_M_ERR && ctx->res && !ctx->res->err[0]) {
+    va_list copy;
+    va_copy(copy, list);
+    vsnprintf(ctx->res->err, sizeof(ctx->res->err), fmt, copy);
+    va_end(copy);
+    n = strlen(ctx->res->err);
+    while (n > 0 && ctx->res->err[n-1] == '\n')
+      ctx->res->err[--n] = 0;
+  }
+  if (ctx->opt.msg && ctx->opt.verbose >= min[level]) {
+    vsnprintf(s, sizeof(s), fmt, list);
+    ctx->opt.msg(ctx->opt.cookie, level, s);
+  }
+}
+
+/* debug message (-vv) */
+
+#ifndef DEBUG
+
+#define dmsg(CTX,FMT,...) (void)0
+
+#else
+static void dmsg(const pngtopi1_ctx * ctx, const char * fmt, ...) FMT23;
+static void dmsg(const pngtopi1_ctx * ctx, const char * fmt, ...)
+{
+  va_list list;
+  va_start(list, fmt);
+  vmsg(ctx, PNGTOPI1_M_DEBUG, fmt, list);
+  va_end(list);
+}
+#endif
+
+/* additional message (-v) */
+static void amsg(const pngtopi1_ctx * ctx, const char * fmt, ...) FMT23;
+static void amsg(const pngtopi1_ctx * ctx, const char * fmt, ...)
+{
+  va_list list;
+  va_start(list, fmt);
+  vmsg(ctx, PNGTOPI1_M_MORE, fmt, list);
+  va_end(list);
+}
+
+/* informational message */
+static void imsg(const pngtopi1_ctx * ctx, const char * fmt, ...) FMT23;
+static void imsg(const pngtopi1_ctx * ctx, const char * fmt, ...)
+{
+  va_list list;
+  va_start(list, fmt);
+  vmsg(ctx, PNGTOPI1_M_INFO, fmt, list);
+  va_end(list);
+}
+
+/* warning message (-q) */
+static void wmsg(const pngtopi1_ctx * ctx, const char * fmt, ...) FMT23;
+static void wmsg(const pngtopi1_ctx * ctx, const char * fmt, ...)
+{
+  va_list list;
+  va_start(list, fmt);
+  vmsg(ctx, PNGTOPI1_M_WARN, fmt, list);
+  va_end(list);
+}
+
+/* error message (-qq) */
+static void emsg(const pngtopi1_ctx * ctx, const char * fmt, ...) FMT23;
+static void emsg(const pngtopi1_ctx * ctx, const char * fmt, ...)
+{
+  va_list list;
+  va_start(list, fmt);
+  vmsg(ctx, PNGTOPI1_M_ERR, fmt, list);
+  va_end(list);
+}
+
+static void syserror(const pngtopi1_ctx * ctx,
+		     const char * ipath, const char * alt)
+{
+  const char * estr = errno ? strerror(errno) : alt;
+  if (ipath)
+    emsg(ctx, "(%d) %s -- %s\n", errno, estr, ipath);
+  else
+    emsg(ctx, "%s\n", estr);
+}
+
+static void notpng(const pngtopi1_ctx * ctx, const char * path)
+{
+  emsg(ctx, "invalid image format -- %s\n", path);
+}
+
+
+/* ----------------------------------------------------------------------
+ |
+ | System functions (with error report)
+ |
+ * ---------------------------------------------------------------------- */
+
+static void * mf_malloc(const pngtopi1_ctx * ctx, size_t l)
+{
+  void * ptr = malloc(l);
+  if(!ptr)
+    syserror(ctx,0,"alloc error");
+  return ptr;
+}
+
+/* Append to the conversion output. Past the end of a caller buffer
+ * the size is only counted.
+ */
+static int out_write(pngtopi1_ctx * ctx, const void * data, size_t len)
+{
+  pngtopi1_out * const res = ctx->res;
+
+  if (res->len + len > res->max) {
+    size_t max = res->max ? res->max : 32768;
+    uint8_t * mem;
+    if (!ctx->own) {
+      res->len += len;
+      return 0;
+    }
+    while (max < res->len + len) max <<= 1;
+    if (mem = realloc(res->data, max), !mem) {
+      syserror(ctx, ctx->name, "alloc error");
+      return -1;
+    }
+    res->data = mem;
+    res->max = max;
+  }
+  memcpy((uint8_t *)res->data + res->len, data, len);
+  res->len += len;
+  return 0;
+}
+
+/* Describe the output image of the conversion. */
+static void out_info(pngtopi1_ctx * ctx, int type,
+		     const struct degasfmt_s * fmt, const char * pngtype)
+{
+  pngtopi1_out * const res = ctx->res;
+
+  res->type = type;
+  res->w = fmt->w;
+  res->h = fmt->h;
+  res->colors = 1 << (1 << fmt->d);
+  if (type == PNG) {
+    snprintf(res->format, sizeof(res->format), "PNG/%s", pngtype);
+    strcpy(res->ext, ".png");
+  } else {
+    const struct degasfmt_s * const f = degas + ((fmt-degas) & ~1)
+      + (type == PCX);
+    strcpy(res->format, f->name);
+    snprintf(res->ext, sizeof(res->ext), ".p%c%c",
+	     type == PCX ? 'c' : 'i', f->name[2]);
+  }
+}
+
+/* ----------------------------------------------------------------------
+ |
+ | Color conversions
+ |
+ * ---------------------------------------------------------------------- */
+
+/* Tables to convert 4 bits component to 8bits (col_4to8 of the
+ * context).
+ *
+ * Various method depending on:
+ * - color component  depth STf:3 STe:4
+ * - The left bit fill method (zero,replicated,full-range)
+ */
+
+/* The index of the table match the ST hardware RGB encoding.
+ *
+ *  STe for backward compatibility uses the bits #3,#7,#11 as the LSB
+ *  of respectively green,blue,red component.
+ */
+
+/* STf: Zero fill */
+static const uint8_t stf_zerofill[16] = {
+  0x00,0x20,0x40,0x60,0x80,0xA0,0xC0,0xE0,
+  0x00,0x20,0x40,0x60,0x80,0xA0,0xC0,0xE0
+};
+
+/* STf: Left bit replicated  */
+static const uint8_t stf_replicated[16] = {
+  0x00,0x24,0x49,0x6D,0x92,0xB6,0xDB,0xFF,
+  0x00,0x24,0x49,0x6D,0x92,0xB6,0xDB,0xFF
+};
+
+/* Stf: Full range */
+static const uint8_t stf_fullrange[16] = {
+  0x00,0x24,0x48,0x6D,0x91,0xB6,0xDA,0xFF,
+  0x00,0x24,0x48,0x6D,0x91,0xB6,0xDA,0xFF
+};
+
+/* STe: Zero fill */
+static const uint8_t ste_zerofill[16] = {
+  0x00,0x20,0x40,0x60,0x80,0xA0,0xC0,0xE0,
+  0x10,0x30,0x50,0x70,0x90,0xB0,0xD0,0xF0
+};
+
+/* STe: Left bit replicated  */
+static const uint8_t ste_replicated[16] = {
+  0x00,0x22,0x44,0x66,0x88,0xAA,0xCC,0xEE,
+  0x11,0x33,0x55,0x77,0x99,0xBB,0xDD,0xFF
+};
+
+#define ste_fullrange ste_replicated
+
+/* Convert STe color component to standard order */
+static const uint8_t ste_to_std[16] = {
+  /* ste: 0 1 2 3 4 5 6 7 8 9 A B C D E F
+     std: 0 2 4 6 8 A C E 1 3 5 7 9 B D F */
+  0x0,0x2,0x4,0x6,0x8,0xA,0xC,0xE,
+  0x1,0x3,0x5,0x7,0x9,0xB,0xD,0xF
+};
+
+/* Convert standard 4bit component to STe color component to */
+
+static const uint8_t std_to_ste[16] = {
+  /* std: 0 1 2 3 4 5 6 7 8 9 A B C D E F
+     ste: 0 8 1 9 2 A 3 B 4 C 5 D 6 E 7 F */
+  0x0,0x8,0x1,0x9,0x2,0xA,0x3,0xB,
+  0x4,0xC,0x5,0xD,0x6,0xE,0x7,0xF
+};
+
+static void set_color_mode(pngtopi1_ctx * ctx, int mode)
+{
+  const uint8_t * col_used;
+  static const char * lbf_names[] = {
+    "zero fill", "left bit replication", "full range"
+  };
+
+  switch(mode) {
+  default:
+    assert( !"unexpected color mode" );
+  case CQ_TBD:
+  case CQ_STF | CQ_LBR:
+    mode = CQ_STF | CQ_LBR;
+    col_used = stf_replicated;
+    break;
+
+  case CQ_STF | CQ_000:
+    col_used = stf_zerofill;
+    break;
+
+  case CQ_STF | CQ_FDR:
+    col_used = stf_fullrange;
+    break;
+
+  case CQ_STE | CQ_000:
+    col_used = ste_zerofill;
+    break;
+
+  case CQ_STE | CQ_LBR:
+    col_used = ste_replicated;
+    break;
+
+  case CQ_STE | CQ_FDR:
+    col_used = ste_fullrange;
+    break;
+  }
+  memcpy(ctx->col_4to8, col_used, 16);
+  ctx->opt.col = mode;
+  amsg(ctx, "Using ST%s colors with %s\n",
+       (mode&3) == CQ_STF ? "":"e", lbf_names[ (mode>>2)-1 ]);
+}
+
+/* 8 bit components to ST (444) RGB. Same for all color modes. */
+static inline uint16_t rgb444(uint8_t r, uint8_t g, uint8_t b)
+{
+  return 0
+    | ( std_to_ste[r>>4] << 8 )
+    | ( std_to_ste[g>>4] << 4 )
+    | ( std_to_ste[b>>4] << 0 )
+    ;
+}
+
+/* ----------------------------------------------------------------------
+ |
+ | Row functions.
+ |
+ | Decode an entire PNG row to 12-bit ST colors.
+ |
+ * ---------------------------------------------------------------------- */
+
+
+#define ROW_CHECK(D,T,C)			\
+  do {						\
+    assert ( png );				\
+    assert ( src );				\
+    assert(png->d == (D));			\
+    assert(png->t == (T));			\
+    assert(png->c == (C));			\
+  } while (0)
+
+typedef void (*row_f)(uint16_t *, const mypng_t *, const png_byte *);
+
+/* ----------------------------------------------------------------------
+ *  Indexed methods
+ *
+ *  Gray scale and palette images are handled as indexed images. The
+ *  color of each index is computed once and rows are only unpacked to
+ *  raw 8-bit indices.
+ **/
+
+static void idx_colors(uint16_t * lut, const mypng_t * png)
+{
+  int i;
+
+  assert( png->c == 1 );
+  if (png->t == PNG_COLOR_TYPE_PALETTE) {
+    assert( png->lut );
+    for (i=0; i<256; ++i) {
+      /* GB: Out of range indices are invalid. Use black. */
+      const png_color * rgb = i < png->lutsz ? &png->lut[i] : 0;
+      lut[i] = rgb ? rgb444(rgb->red,rgb->green,rgb->blue) : rgb444(0,0,0);
+    }
+  } else {
+    const int max = (1 << png->d) - 1;
+    assert( png->t == PNG_COLOR_TYPE_GRAY );
+    for (i=0; i<256; ++i)
+      lut[i] = 0x111 * std_to_ste[ (i & max) * 255 / max >> 4 ];
+  }
+}
+
+static const uint8_t * idx_unpack(uint8_t * dst, const mypng_t * png,
+				  const png_byte * src)
+{
+  uint8_t * const d0 = dst;
+  int x;
+
+  assert( png );
+  assert( src );
+  assert( png->c == 1 );
+
+  switch (png->d) {
+  case 1:
+    for (x=0; x<png->w; x += 8, dst += 8) {
+      const uint_t b = *src++;
+      dst[0] = b>>7&1; dst[1] = b>>6&1; dst[2] = b>>5&1; dst[3] = b>>4&1;
+      dst[4] = b>>3&1; dst[5] = b>>2&1; dst[6] = b>>1&1; dst[7] = b>>0&1;
+    }
+    break;
+  case 2:
+    for (x=0; x<png->w; x += 4, dst += 4) {
+      const uint_t b = *src++;
+      dst[0] = b>>6&3; dst[1] = b>>4&3; dst[2] = b>>2&3; dst[3] = b>>0&3;
+    }
+    break;
+  case 4:
+    for (x=0; x<png->w; x += 2, dst += 2) {
+      const uint_t b = *src++;
+      dst[0] = b>>4; dst[1] = b&15;
+    }
+    break;
+  case 8:
+    /* Nothing to unpack */
+    return src;
+  default:
+    assert( !"unexpected bit depth" );
+  }
+  return d0;
+}
+
+/* ----------------------------------------------------------------------
+ *  Direct colors
+ **/
+
+#ifdef __SSE2__
+
+/* Convert 4 pixels stored as 32-bit R,G,B,x lanes to 12-bit ST colors
+ * (also in 32-bit lanes). This is rgb444() for all bytes at once:
+ * the 4 MSB of each component are rotated right by one bit (STe LSB
+ * goes to bit #3) then the 3 nibbles are gathered.
+ */
+static inline __m128i rgb_st4(__m128i v)
+{
+  v = _mm_or_si128(
+    _mm_and_si128(_mm_srli_epi16(v,5), _mm_set1_epi8(0x07)),
+    _mm_and_si128(_mm_srli_epi16(v,1), _mm_set1_epi8(0x08)));
+  return _mm_or_si128(
+    _mm_or_si128(
+      _mm_slli_epi32(_mm_and_si128(v, _mm_set1_epi32(0x00000F)), 8),
+      _mm_srli_epi32(_mm_and_si128(v, _mm_set1_epi32(0x000F00)), 4)),
+    _mm_srli_epi32(_mm_and_si128(v, _mm_set1_epi32(0x0F0000)), 16));
+}
+
+#endif
+
+/* Convert a row of 8-bit RGB (bpp=3) or RGBA (bpp=4) pixels. */
+static void rgb_row(uint16_t * dst, const png_byte * src, int w, int bpp)
+{
+  int x = 0;
+
+  assert( bpp == 3 || bpp == 4 );
+
+#ifdef __SSE2__
+  if (bpp == 4)
+    for (; x+8 <= w; x += 8, src += 32) {
+      const __m128i a = _mm_loadu_si128((const __m128i *)src);
+      const __m128i b = _mm_loadu_si128((const __m128i *)(src+16));
+      _mm_storeu_si128((__m128i *)(dst+x),
+		       _mm_packs_epi32(rgb_st4(a), rgb_st4(b)));
+    }
+# ifdef __SSSE3__
+  else {
+    /* Spread 4 RGB pixels to 32-bit lanes. Each load reads 4 bytes
+     * past the pixels it uses so stop early enough. */
+    const __m128i spread = _mm_setr_epi8(
+      0,1,2,-1, 3,4,5,-1, 6,7,8,-1, 9,10,11,-1);
+    for (; x+8 <= w && (x+8)*3+4 <= w*3; x += 8, src += 24) {
+      const __m128i a = _mm_shuffle_epi8(
+	_mm_loadu_si128((const __m128i *)src), spread);
+      const __m128i b = _mm_shuffle_epi8(
+	_mm_loadu_si128((const __m128i *)(src+12)), spread);
+      _mm_storeu_si128((__m128i *)(dst+x),
+		       _mm_packs_epi32(rgb_st4(a), rgb_st4(b)));
+    }
+  }
+# endif
+#endif
+
+  for (; x<w; ++x, src += bpp)
+    dst[x] = rgb444(src[0],src[1],src[2]);
+
+#ifdef DEBUG
+  for (src -= w*bpp, x=0; x<w; ++x, src += bpp)
+    assert( dst[x] == rgb444(src[0],src[1],src[2]) );
+#endif
+}
+
+static void row_rgb(uint16_t * dst, const mypng_t * png, const png_byte * src)
+{
+  ROW_CHECK(8,PNG_COLOR_TYPE_RGB,3);
+  rgb_row(dst, src, png->w, 3);
+}
+
+static void row_rgba(uint16_t * dst, const mypng_t * png, const png_byte * src)
+{
+  ROW_CHECK(8,PNG_COLOR_TYPE_RGBA,4);
+  rgb_row(dst, src, png->w, 4);
+}
+
+/* ----------------------------------------------------------------------
+ |
+ | Bitplane functions.
+ |
+ * ---------------------------------------------------------------------- */
+
+/* ----------------------------------------------------------------------
+ *  Chunky to planar
+ *
+ *  Convert a row of 8-bit color indices to the interleaved ST bitplane
+ *  layout: for each 16-pixels tile, one big-endian word per bitplane
+ *  starting with the least significant one. The row width must be a
+ *  multiple of 16 and indices must be less than (1<<(1<<log2plans)).
+ **/
+
+#if defined(__AVX2__)
+
+static void c2p_row(uint8_t * dst, const uint8_t * idx, int w, int log2plans)
+{
+  /* Reverse bytes in each 128-bit lane so that pixel #0 of each tile
+   * ends up in the most significant bit of the movemask result. */
+  const __m256i rev = _mm256_setr_epi8(
+    15,14,13,12,11,10,9,8,7,6,5,4,3,2,1,0,
+    15,14,13,12,11,10,9,8,7,6,5,4,3,2,1,0);
+  const int step = 2 << log2plans;	/* bytes per tile */
+  int x;
+
+  assert( ! (w & 15) );
+
+  for (x=0; x+32 <= w; x += 32, idx += 32, dst += step<<1) {
+    const __m256i v = _mm256_shuffle_epi8(
+      _mm256_loadu_si256((const __m256i *)idx), rev);
+    uint32_t m;
+    switch (log2plans) {
+    case 2:
+      m = _mm256_movemask_epi8(_mm256_slli_epi16(v,4));
+      dst[6] = m>>8; dst[7] = m; dst[step+6] = m>>24; dst[step+7] = m>>16;
+      m = _mm256_movemask_epi8(_mm256_slli_epi16(v,5));
+      dst[4] = m>>8; dst[5] = m; dst[step+4] = m>>24; dst[step+5] = m>>16;
+      /* fall through */
+    case 1:
+      m = _mm256_movemask_epi8(_mm256_slli_epi16(v,6));
+      dst[2] = m>>8; dst[3] = m; dst[step+2] = m>>24; dst[step+3] = m>>16;
+      /* fall through */
+    case 0:
+      m = _mm256_movemask_epi8(_mm256_slli_epi16(v,7));
+      dst[0] = m>>8; dst[1] = m; dst[step+0] = m>>24; dst[step+1] = m>>16;
+      break;
+    default:
+      assert( !"unexpected number of bitplanes" );
+    }
+  }
+
+  if (x < w) {
+    /* Last odd tile */
+    const __m128i v = _mm_shuffle_epi8(
+      _mm_loadu_si128((const __m128i *)idx), _mm256_castsi256_si128(rev));
+    uint32_t m;
+    switch (log2plans) {
+    case 2:
+      m = _mm_movemask_epi8(_mm_slli_epi16(v,4)); dst[6] = m>>8; dst[7] = m;
+      m = _mm_movemask_epi8(_mm_slli_epi16(v,5)); dst[4] = m>>8; dst[5] = m;
+      /* fall through */
+    case 1:
+      m = _mm_movemask_epi8(_mm_slli_epi16(v,6)); dst[2] = m>>8; dst[3] = m;
+      /* fall through */
+    case 0:
+      m = _mm_movemask_epi8(_mm_slli_epi16(v,7)); dst[0] = m>>8; dst[1] = m;
+    }
+  }
+}
+
+#elif defined(__SSE2__)
+
+static void c2p_row(uint8_t * dst, const uint8_t * idx, int w, int log2plans)
+{
+  const int step = 2 << log2plans;	/* bytes per tile */
+  int x;
+
+  assert( ! (w & 15) );
+
+  for (x=0; x<w; x += 16, idx += 16, dst += step) {
+    __m128i v = _mm_loadu_si128((const __m128i *)idx);
+    uint_t m;
+
+    /* Reverse the 16 bytes so that pixel #0 ends up in the most
+     * significant bit of the movemask result. */
+    v = _mm_shuffle_epi32(v, _MM_SHUFFLE(0,1,2,3));
+    v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2,3,0,1));
+    v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2,3,0,1));
+    v = _mm_or_si128(_mm_slli_epi16(v,8), _mm_srli_epi16(v,8));
+
+    /* Shift bit #z of each byte to bit #7 and collect them. */
+    switch (log2plans) {
+    case 2:
+      m = _mm_movemask_epi8(_mm_slli_epi16(v,4)); dst[6] = m>>8; dst[7] = m;
+      m = _mm_movemask_epi8(_mm_slli_epi16(v,5)); dst[4] = m>>8; dst[5] = m;
+      /* fall through */
+    case 1:
+      m = _mm_movemask_epi8(_mm_slli_epi16(v,6)); dst[2] = m>>8; dst[3] = m;
+      /* fall through */
+    case 0:
+      m = _mm_movemask_epi8(_mm_slli_epi16(v,7)); dst[0] = m>>8; dst[1] = m;
+      break;
+    default:
+      assert( !"unexpected number of bitplanes" );
+    }
+  }
+}
+
+#else
+
+static void c2p_row(uint8_t * dst, const uint8_t * idx, int w, int log2plans)
+{
+  /* Spread the 4 bits of an index into 4 16-bit lanes. Shifting the
+   * accumulator shifts all the bitplanes at once. */
+  static const uint64_t spread[16] = {
+#   define S(I) ( (uint64_t)((I)>>0&1) <<  0 | (uint64_t)((I)>>1&1) << 16 | \
+                  (uint64_t)((I)>>2&1) << 32 | (uint64_t)((I)>>3&1) << 48 )
+    S(0x0),S(0x1),S(0x2),S(0x3),S(0x4),S(0x5),S(0x6),S(0x7),
+    S(0x8),S(0x9),S(0xA),S(0xB),S(0xC),S(0xD),S(0xE),S(0xF)
+#   undef S
+  };
+  const int nbplans = 1 << log2plans;
+  int x, i, z;
+
+  assert( ! (w & 15) );
+
+  for (x=0; x<w; x += 16) {
+    uint64_t acc = 0;
+    for (i=0; i<16; ++i) {
+      assert( *idx < 16 );
+      acc = ( acc << 1 ) | spread[ *idx++ & 15 ];
+    }
+    for (z=0; z<nbplans; ++z, acc >>= 16) {
+      *dst++ = acc >> 8;
+      *dst++ = acc;
+    }
+  }
+}
+
+#endif
+
+/* ----------------------------------------------------------------------
+ *  Planar to chunky
+ *
+ *  Convert a row of interleaved ST bitplanes to a PNG packed row of
+ *  (1<<log2plans) bits per pixel. Each bitplane byte (8 pixels) is
+ *  spread by a table lookup so that every bitplane is merged with a
+ *  single shift and or.
+ **/
+
+#define SPREAD(B,S) (				\
+    ( (uint32_t)((B)>>0&1) << (0*(S)) ) |	\
+    ( (uint32_t)((B)>>1&1) << (1*(S)) ) |	\
+    ( (uint32_t)((B)>>2&1) << (2*(S)) ) |	\
+    ( (uint32_t)((B)>>3&1) << (3*(S)) ) |	\
+    ( (uint32_t)((B)>>4&1) << (4*(S)) ) |	\
+    ( (uint32_t)((B)>>5&1) << (5*(S)) ) |	\
+    ( (uint32_t)((B)>>6&1) << (6*(S)) ) |	\
+    ( (uint32_t)((B)>>7&1) << (7*(S)) ) )
+#define SPREAD4(B,S)   SPREAD(B,S),SPREAD(B+1,S),SPREAD(B+2,S),SPREAD(B+3,S)
+#define SPREAD16(B,S)  SPREAD4(B,S),SPREAD4(B+4,S),SPREAD4(B+8,S),SPREAD4(B+12,S)
+#define SPREAD64(B,S)  SPREAD16(B,S),SPREAD16(B+16,S),SPREAD16(B+32,S),\
+    SPREAD16(B+48,S)
+#define SPREAD256(S)   SPREAD64(0,S),SPREAD64(64,S),SPREAD64(128,S),\
+    SPREAD64(192,S)
+
+/* 8 bits to 8 2-bit pixels */
+static const uint16_t p2c_spread2[256] = { SPREAD256(2) };
+
+/* 8 bits to 8 4-bit pixels */
+static const uint32_t p2c_spread4[256] = { SPREAD256(4) };
+
+static void p2c_row(uint8_t * dst, const uint8_t * src, int w, int log2plans)
+{
+  int x;
+
+  assert( ! (w & 15) );
+
+  switch (log2plans) {
+
+  case 0:
+    /* Single bitplane is already a 1-bit PNG row */
+    memcpy(dst, src, w >> 3);
+    break;
+
+  case 1:
+    for (x=0; x<w; x += 16, src += 4, dst += 4) {
+      const uint_t hi = p2c_spread2[src[0]] | p2c_spread2[src[2]] << 1;
+      const uint_t lo = p2c_spread2[src[1]] | p2c_spread2[src[3]] << 1;
+      dst[0] = hi >> 8; dst[1] = hi;
+      dst[2] = lo >> 8; dst[3] = lo;
+    }
+    break;
+
+  case 2:
+    for (x=0; x<w; x += 16, src += 8, dst += 8) {
+      const uint32_t hi = 0
+	| p2c_spread4[src[0]] << 0 | p2c_spread4[src[2]] << 1
+	| p2c_spread4[src[4]] << 2 | p2c_spread4[src[6]] << 3;
+      const uint32_t lo = 0
+	| p2c_spread4[src[1]] << 0 | p2c_spread4[src[3]] << 1
+	| p2c_spread4[src[5]] << 2 | p2c_spread4[src[7]] << 3;
+      dst[0] = hi >> 24; dst[1] = hi >> 16; dst[2] = hi >> 8; dst[3] = hi;
+      dst[4] = lo >> 24; dst[5] = lo >> 16; dst[6] = lo >> 8; dst[7] = lo;
+    }
+    break;
+
+  default:
+    assert( !"unexpected number of bitplanes" );
+  }
+}
+
+/* Same as p2c_row() but with 8-bit color indices. */
+static void p2c_idx(uint8_t * dst, const uint8_t * src, int w, int log2plans)
+{
+  const int nbplans = 1 << log2plans;
+  int x, z, i;
+
+  assert( ! (w & 15) );
+
+  for (x=0; x<w; x += 16, src += nbplans << 1) {
+    for (i=0; i<2; ++i, dst += 8) {
+      uint32_t v = 0;
+      for (z=0; z<nbplans; ++z)
+	v |= p2c_spread4[src[(z<<1)+i]] << z;
+      dst[0] = v >> 28; dst[1] = v >> 24 & 15;
+      dst[2] = v >> 20 & 15; dst[3] = v >> 16 & 15;
+      dst[4] = v >> 12 & 15; dst[5] = v >>  8 & 15;
+      dst[6] = v >>  4 & 15; dst[7] = v & 15;
+    }
+  }
+}
+
+/* Remap the color indices of bitplane rows in place. */
+static void remap_rows(uint8_t * bits, int w, int h, int log2plans,
+		       const uint8_t * remap)
+{
+  const int bytes_per_line = (w >> 3) << log2plans;
+  uint8_t idx[640];
+  int x, y;
+
+  assert( w <= 640 );
+  for (y=0; y<h; ++y, bits += bytes_per_line) {
+    p2c_idx(idx, bits, w, log2plans);
+    for (x=0; x<w; ++x)
+      idx[x] = remap[idx[x]];
+    c2p_row(bits, idx, w, log2plans);
+  }
+}
+
+/* ----------------------------------------------------------------------
+ |
+ | Image functions.
+ |
+ * ---------------------------------------------------------------------- */
+
+static void mypng_free(mypng_t * png)
+{
+  if (png->png)
+    png_destroy_read_struct(&png->png, png->inf ? &png->inf : 0, 0);
+  free(png->arena);
+  png->arena = 0;
+  png->rows = 0;
+  png->lut = 0;
+}
+
+static void myimg_free(myimg_t ** img)
+{
+  assert( img );
+  if (*img) {
+    if ((*img)->png.type == PNG)
+      mypng_free(&(*img)->png);
+    free(*img);
+    *img = 0;
+  }
+}
+
+/* Allocate n rows in a single block. Each row is 16 bytes aligned. */
+static int mypng_alloc_rows(const pngtopi1_ctx * ctx, mypng_t * png, int n)
+{
+  const size_t stride =
+    ( png_get_rowbytes(png->png,png->inf) + 15 ) & ~(size_t)15;
+  uint8_t * row;
+  int y;
+
+  assert( !png->arena );
+  png->arena = mf_malloc(ctx, n * (sizeof(png_bytep) + stride) + 15);
+  if (!png->arena)
+    return -1;
+  png->rows = png->arena;
+  row = (uint8_t *) (png->rows + n);
+  row += -(uintptr_t)row & 15;
+  for (y=0; y<n; ++y, row += stride)
+    png->rows[y] = row;
+  return 0;
+}
+
+static myimg_t * mypng_init(const pngtopi1_ctx * ctx, const char * path)
+{
+  /* Only the png member is allocated: fill it as a mypng_t. */
+  mypng_t * png = mf_malloc(ctx, sizeof(*png));
+  if (png) {
+    memset(png, 0, sizeof(*png));
+    strcpy((char*)png->magic, "PNG");
+    png->path = path ? path : "<mypng>";
+    png->type = PNG;
+  }
+  return (myimg_t *) png;
+}
+
+/* libpng errors and warnings are context messages. The error
+ * pointer is the context (0: silent). */
+static void mypng_error(png_structp png, png_const_charp msg)
+{
+  const pngtopi1_ctx * const ctx = png_get_error_ptr(png);
+  if (ctx)
+    emsg(ctx, "libpng error: %s -- %s\n", msg, ctx->name);
+  png_longjmp(png, 1);
+}
+
+static void mypng_warning(png_structp png, png_const_charp msg)
+{
+  const pngtopi1_ctx * const ctx = png_get_error_ptr(png);
+  if (ctx)
+    wmsg(ctx, "libpng warning: %s -- %s\n", msg, ctx->name);
+}
+
+/* libpng I/O from the input bytes and to the conversion output */
+static void mypng_in_read(png_structp png, png_bytep data, png_size_t len)
+{
+  myin_t * const in = png_get_io_ptr(png);
+  if (len > in->len - in->pos)
+    png_error(png, "Read Error");
+  memcpy(data, in->data + in->pos, len);
+  in->pos += len;
+}
+
+static void mypng_out_write(png_structp png, png_bytep data, png_size_t len)
+{
+  if (-1 == out_write(png_get_io_ptr(png), data, len))
+    png_longjmp(png, 1);		/* reported */
+}
+
+static void mypng_out_flush(png_structp png)
+{
+  (void) png;
+}
+
+static myimg_t * mypix_from_mem(pngtopi1_ctx * ctx,
+				const uint8_t * data, size_t len);
+
+static myimg_t * read_img(pngtopi1_ctx * ctx,
+			  const uint8_t * data, size_t len)
+{
+  myimg_t * img = 0;
+
+  if (len < 8) {
+    emsg(ctx, "missing input data (%u/%u) -- %s\n\n",
+	 (uint_t)len, 8u, ctx->name);
+    goto error;
+  }
+
+  if (png_sig_cmp(data, 0, 8)) {
+
+    /* -------------------
+     * Trying Degas format
+     **/
+    if (img = mypix_from_mem(ctx, data, len), !img)
+      goto exit;
+  }
+
+  else {
+    /* ---------------
+     * Trying with PNG
+     */
+
+    mypng_t * png;
+
+    img = mypng_init(ctx, ctx->name);
+    if (!img)
+      goto error;
+    png = & img->png;
+    png->in.data = data;
+    png->in.len = len;
+    png->in.pos = 8;
+
+    png->png = png_create_read_struct(PNG_LIBPNG_VER_STRING, ctx,
+				      mypng_error, mypng_warning);
+    if (!png->png)
+      goto png_error;
+
+    png->inf = png_create_info_struct(png->png);
+    if (!png->inf)
+      goto png_error;
+
+    if (setjmp(png_jmpbuf(png->png)))
+      goto error;
+
+    png_set_read_fn(png->png, &png->in, mypng_in_read);
+    png_set_sig_bytes(png->png,8);
+    png_read_info(png->png, png->inf);
+
+    png->w = png_get_image_width(png->png, png->inf);
+    png->h = png_get_image_height(png->png, png->inf);
+    png->d = png_get_bit_depth(png->png, png->inf);
+    png->t = png_get_color_type(png->png, png->inf);
+    png->i = png_get_interlace_type(png->png, png->inf);
+    png->z = png_get_compression_type(png->png, png->inf);
+    png->f = png_get_filter_type(png->png,png->inf);
+    png->c = png_get_channels(png->png, png->inf);
+    png->p = png_set_interlace_handling(png->png);
+    png_read_update_info(png->png, png->inf);
+
+    /* read file */
+    if (setjmp(png_jmpbuf(png->png)))
+      goto error;
+
+    png_get_PLTE(png->png, png->inf, &png->lut, &png->lutsz);
+    if (png->lutsz) {
+      const png_byte m = (ctx->opt.col&3) == CQ_STE ? 0x0F0 : 0x1F;
+      int i;
+
+      amsg(ctx, "PNG color look-up table has %d entries:\n", png->lutsz);
+      for (i=0; i<png->lutsz; ++i)
+	amsg(ctx,
+	  "%3d #%02X%02X%02X $%03x #%02X%02X%02X\n",
+	  i,png->lut[i].red,png->lut[i].green,png->lut[i].blue,
+	  rgb444(png->lut[i].red,png->lut[i].green,png->lut[i].blue),
+	  png->lut[i].red&m, png->lut[i].green&m, png->lut[i].blue&m);
+    }
+
+    /* Interlaced images need all their rows. Otherwise rows are
+     * converted as soon as they are read. */
+    if (mypng_alloc_rows(ctx, png, png->p > 1 ? png->h : 1))
+      goto error;
+
+    /* Rows are read on demand by mypix_from_png() */
+  }
+
+exit:
+  return img;
+
+png_error:
+  syserror(ctx, ctx->name, "libpng error");
+error:
+  myimg_free(&img);
+  goto exit;
+}
+
+static const char * mypng_typestr(pngtopi1_ctx * ctx, int type)
+{
+# define CASE_COLOR_TYPE(A) case PNG_COLOR_TYPE_##A: return #A
+# define CASE_COLOR_MASK(A) case PNG_COLOR_MASK_##A: return #A
+  char * const s = ctx->typestr;
+  switch (type) {
+    CASE_COLOR_TYPE(GRAY);	     /* (bit depths 1, 2, 4, 8, 16) */
+    CASE_COLOR_TYPE(GRAY_ALPHA);     /* (bit depths 8, 16) */
+    CASE_COLOR_TYPE(PALETTE);	     /* (bit depths 1, 2, 4, 8) */
+    CASE_COLOR_TYPE(RGB);	     /* (bit_depths 8, 16) */
+    CASE_COLOR_TYPE(RGB_ALPHA);	     /* (bit_depths 8, 16) */
+    /* CASE_COLOR_MASK(PALETTE); */
+    /* CASE_COLOR_MASK(COLOR); */
+    /* CASE_COLOR_MASK(ALPHA); */
+  }
+  sprintf(s,"?%02x?", type & 255);
+  return s;
+}
+
+static int lumi(int x)
+{
+  int r,g,b;
+  assert( (x & 0xfff) == x );
+  r = ste_to_std[x>>8];
+  g = ste_to_std[(x>>4)&15];
+  b = ste_to_std[x&15];
+  return r*2 + g*4 + b;
+}
+
+/* By brightness then the most used first then by color */
+static int cl_cmp(const void * _a, const void * _b)
+{
+  const colcnt_t * const a = _a;
+  const colcnt_t * const b = _b;
+  int d = lumi(a->rgb) - lumi(b->rgb);
+  if (!d) d = b->cnt - a->cnt;
+  if (!d) d = a->rgb - b->rgb;
+  return d;
+}
+
+static void sort_colorbright(colcnt_t * cc, int n)
+{
+  qsort(cc, n, sizeof(colcnt_t), cl_cmp);
+}
+
+static myimg_t * mypix_alloc(pngtopi1_ctx * ctx, int id, const char * path)
+{
+  myimg_t * img;
+
+  assert( (uint_t) id < 6u );
+
+  img = mf_malloc(ctx, sizeof(mypix_t));
+  if (img) {
+    strcpy((char*)img->pix.magic, degas[id].name);
+    img->pix.w = degas[id].w;
+    img->pix.h = degas[id].h;
+    img->pix.d = degas[id].d;
+    img->pix.c = degas[id].c;
+    img->pix.path = path ? path :"<mypix>";
+    img->pix.type = degas[id].rle ? PCX : PIX;
+  }
+  return img;
+}
+
+
+/* Decode the RLE bitplanes of one scanline into the interleaved
+ * layout.
+ *
+ * @param  dst   scanline to decode into.
+ * @param  psrc  pointer to the RLE data (updated).
+ * @param  end   end of the RLE data.
+ * @param  w,d   image width and log2 of the number of plans.
+ * @param  y     line number and
+ * @param  path  file name (error messages).
+ * @retval -1 on error
+ */
+static int rle_read_line(const pngtopi1_ctx * ctx, uint8_t * dst, const uint8_t ** psrc,
+			 const uint8_t * const end,
+			 int w, int d, int y, const char * path)
+{
+  const int bytes_per_plan = (w >> 4) << 1;
+  const int bytes_per_tile = 2 << d;
+  const uint8_t * src = *psrc;
+  int x, z;
+
+  assert( bytes_per_plan <= 80 );
+
+  /* For each plan */
+  for ( z=0; z < 1<<d; ++z ) {
+    uint8_t * const row = dst + (z<<1);
+
+    /* decode an entire bitplan line */
+    for (x=0; x<bytes_per_plan; ) {
+      int n;
+
+      if (src >= end)
+	goto truncated;
+
+      if (*src >= 128) {
+	/* Fill 257-code times the next byte */
+	uint8_t v;
+	n = 257 - *src++;
+	if (x+n > bytes_per_plan) {
+	  emsg(ctx, "rle-fill overflow line:%d plan:%d byte:%d\n",y,z,x);
+	  return -1;
+	}
+	if (src >= end)
+	  goto truncated;
+	v = *src++;
+	if (bytes_per_tile == 2)
+	  /* Single bitplan is not interleaved */
+	  memset(row+x, v, n), x += n;
+	else {
+	  /* One store per word of the plan: the other plans sit in
+	   * between, so there is no contiguous span to memset(). */
+	  const uint16_t vv = v * 0x0101;
+	  if (x & 1)
+	    row[ (x>>1)*bytes_per_tile + 1 ] = v, ++x, --n;
+	  for (; n >= 2; n -= 2, x += 2)
+	    memcpy(row + (x>>1)*bytes_per_tile, &vv, 2);
+	  if (n)
+	    row[ (x>>1)*bytes_per_tile ] = v, ++x;
+	}
+      } else {
+	/* Copy code+1 bytes */
+	n = *src++ + 1;
+	if (x+n > bytes_per_plan) {
+	  emsg(ctx, "rle-copy overflow line:%d plan:%d byte:%d\n",y,z,x);
+	  return -1;
+	}
+	if (end-src < n)
+	  goto truncated;
+	if (bytes_per_tile == 2)
+	  memcpy(row+x, src, n), x += n, src += n;
+	else
+	  for (; n; --n, ++x)
+	    row[ (x>>1)*bytes_per_tile + (x&1) ] = *src++;
+      }
+    }
+    assert( x == bytes_per_plan );
+  }
+  *psrc = src;
+  return 0;
+
+truncated:
+  emsg(ctx, "missing rle data line:%d plan:%d byte:%d -- %s\n",
+       y, z, x, path);
+  return -1;
+}
+
+/* Decode a whole RLE image from memory. */
+static int rle_read(const pngtopi1_ctx * ctx, mypix_t * pix,
+		    const uint8_t * src, size_t len)
+{
+  const int bytes_per_line = (pix->w >> 3) << pix->d;
+  const uint8_t * const end = src + len;
+  uint8_t * dst = pix->bits + 34;
+  int y;
+
+  /* For each line */
+  for ( y=0; y < pix->h; ++y, dst += bytes_per_line )
+    if (rle_read_line(ctx, dst, &src, end, pix->w, pix->d, y, pix->path))
+      return -1;
+  return 0;
+}
+
+
+static myimg_t * mypix_from_mem(pngtopi1_ctx * ctx,
+				 const uint8_t * data, size_t len)
+{
+  int id, i;
+  myimg_t * img = 0;
+
+  if (len < 34) {
+    emsg(ctx, "missing input data (%u/%u) -- %s\n\n",
+	 (uint_t) len, 34u, ctx->name);
+    return 0;
+  }
+
+  id = (data[0]<<8) | data[1];
+  for (i=0; i<6; ++i) {
+    if (id == degas[i].id) {
+      if (len < degas[i].minsz) {
+	emsg(ctx, "file length (%u) is too short for %s image -- %s\n",
+	     (uint_t) len, degas[i].name, ctx->name);
+	return 0;
+      }
+      break;
+    }
+  }
+  if (i == 6) {
+    notpng(ctx, ctx->name);
+    return 0;
+  }
+  dmsg(ctx, "%s detected\n", degas[i].name);
+
+  img = mypix_alloc(ctx, i, ctx->name);
+  if (!img)
+    return 0;
+
+  memcpy(img->pix.bits,data,34);	/* copy header */
+  if ( ! degas[i].rle )
+    /* Uncompressed Degas image */
+    memcpy(img->pix.bits+34, data+34, 32000);
+  else if ( -1 == rle_read(ctx, &img->pix, data+34, len-34) )
+    /* Uncompress the RLE data */
+    myimg_free(&img);
+
+  return img;
+}
+
+
+/* Dense color to slot table. */
+typedef struct colslot_s colslot_t;
+struct colslot_s {
+  int n, max;				/* used and maximum slots */
+  colcnt_t cc[16];			/* slot color and count */
+  uint8_t slot[0x1000];			/* color to slot (255:none) */
+};
+
+static void colslot_init(colslot_t * cs, int max)
+{
+  assert( max <= 16 );
+  cs->n = 0;
+  cs->max = max;
+  memset(cs->slot, 255, sizeof(cs->slot));
+}
+
+/* Get the slot of a color, allocate a new one if needed.
+ * @retval -1 too many colors
+ */
+static inline int colslot_get(colslot_t * cs, uint_t rgb)
+{
+  int k;
+  assert( rgb < 0x1000 );
+  if (k = cs->slot[rgb], k == 255) {
+    if (cs->n == cs->max)
+      return -1;
+    cs->slot[rgb] = k = cs->n++;
+    cs->cc[k].rgb = rgb;
+    cs->cc[k].cnt = 0;
+  }
+  return k;
+}
+
+/* Read the next PNG row (or next pass row for interlaced images). */
+static int mypng_read_row(mypng_t * png, png_bytep row)
+{
+  if (setjmp(png_jmpbuf(png->png)))
+    return png->err = -1;
+  png_read_row(png->png, row, 0);
+  return 0;
+}
+
+static myimg_t * mypix_from_png(pngtopi1_ctx * ctx, mypng_t * png)
+{
+  static const struct pngsup_s {
+    int d,c,t;				/* depth,channel,type */
+    row_f row;				/* get row function (0:indexed) */
+  } supported[] = {
+    /* 320 x 200 */
+    { 1, 1, PNG_COLOR_TYPE_GRAY,    0		 },
+    { 2, 1, PNG_COLOR_TYPE_GRAY,    0		 },
+    { 4, 1, PNG_COLOR_TYPE_GRAY,    0		 },
+    { 8, 1, PNG_COLOR_TYPE_GRAY,    0		 },
+    { 1, 1, PNG_COLOR_TYPE_PALETTE, 0		 },
+    { 2, 1, PNG_COLOR_TYPE_PALETTE, 0		 },
+    { 4, 1, PNG_COLOR_TYPE_PALETTE, 0		 },
+    { 8, 1, PNG_COLOR_TYPE_PALETTE, 0		 },
+    { 8, 3, PNG_COLOR_TYPE_RGB,	    row_rgb	 },
+    { 8, 4, PNG_COLOR_TYPE_RGBA,    row_rgba	 },
+    /**/
+    { 0,0,0,0 }
+  };
+
+  const struct pngsup_s * s;
+  myimg_t * img = 0;
+  uint8_t * bits, remap[256], order[16], idx[640];
+  const uint8_t * src;
+  uint16_t row[640];
+  int x, y, i, pass, log2plans, lutsiz, lutmax, ncolors, bytes_per_line;
+
+  uint16_t lut[256];
+  uint32_t hist[256];
+  colslot_t cs;
+  colcnt_t * const colcnt = cs.cc;
+
+  int id;
+
+  for (id=0; id<6; id += 2)
+    if (png->w == degas[id].w && png->h == degas[id].h)
+      break;
+
+  if (id == 6) {
+    emsg(ctx, "incompatible image dimension <%dx%d> -- %s\n",
+	 png->w,png->h,png->path);
+    return 0;
+  }
+
+  log2plans = degas[id].d;
+  lutmax    = 1<<(1<<log2plans);
+  bytes_per_line = (png->w >> 3) << log2plans;
+  assert( lutmax <= 16 );
+
+  dmsg(ctx, "search for d:%2d c:%2d %s(%d)\n",
+       png->d,png->c,mypng_typestr(ctx, png->t),png->t);
+  for (s=supported; s->d; ++s) {
+    dmsg(ctx, "    versus d:%2d c:%2d %s(%d)\n",
+	 s->d,s->c,mypng_typestr(ctx, s->t),s->t);
+    if (s->d == png->d && s->c == png->c && s->t == png->t)
+      break;
+  }
+
+  if (!s->d) {
+    emsg(ctx, "incompatible image format -- %s\n",png->path);
+    return 0;
+  }
+
+  assert( (( (((15+png->w)>>4)<<1) << log2plans) * png->h) == 32000 );
+
+  if (img = mypix_alloc(ctx, id, png->path), !img)
+    return 0;
+
+  colslot_init(&cs, lutmax);
+
+  if (!s->row) {
+    /* Indexed image: count raw indices and give a slot to the color
+     * of each index the first time it is used. */
+    idx_colors(lut, png);
+    memset(hist, 0, sizeof(hist));
+    memset(remap, 255, sizeof(remap));
+  }
+
+  /* Read rows progressively. Interlaced images have their rows
+   * completed by the last pass only. As soon as a row is completed
+   * its colors are given a slot (stopping if there are too many) and
+   * the slots are written to the bitplanes. */
+  for ( pass=0; pass < png->p; ++pass ) {
+    bits = img->pix.bits + 34;
+    for ( y=0; y < png->h; ++y, bits += bytes_per_line ) {
+      png_bytep const rowp = png->rows[png->p > 1 ? y : 0];
+
+      if (mypng_read_row(png, rowp))
+	goto png_error;
+      if (pass+1 < png->p)
+	continue;
+
+      if (!s->row) {
+	src = idx_unpack(idx,png,rowp);
+	for ( i=0; i < png->w; ++i ) {
+	  const int c = src[i];
+	  if (remap[c] == 255) {
+	    const int k = colslot_get(&cs, lut[c]);
+	    if (k < 0)
+	      goto too_many;
+	    remap[c] = k;
+	  }
+	  ++ hist[c];
+	  idx[i] = remap[c];
+	}
+      } else {
+	s->row(row,png,rowp);
+	for ( i=0; i < png->w; ++i ) {
+	  const int k = colslot_get(&cs, row[i]);
+	  if (k < 0)
+	    goto too_many;
+	  ++ colcnt[k].cnt;
+	  idx[i] = k;
+	}
+      }
+      c2p_row(bits, idx, png->w, log2plans);
+    }
+  }
+
+  if (!s->row)
+    for ( i=0; i < 256; ++i )
+      if (hist[i])
+	colcnt[remap[i]].cnt += hist[i];
+  x = cs.n;
+
+#ifdef DEBUG
+  for (y=0; y<x; ++y)
+    dmsg(ctx, " #%02d $%03X is used %5d times\n",
+	 y, colcnt[y].rgb, colcnt[y].cnt);
+#endif
+
+  if (x < lutmax)
+    amsg(ctx, "using only %d colors out of %d\n", x, lutmax);
+
+  /* Supporting by brightness is only necessary for P?3 images */
+  sort_colorbright(colcnt, x);
+
+#ifdef DEBUG
+  dmsg(ctx, "Sorted by lumi\n");
+  for (y=0; y < x; ++y) {
+    dmsg(ctx, " #%02d $%03X %+6d\n", y, colcnt[y].rgb, colcnt[y].cnt);
+  }
+#endif
+
+  lut[0] = 0;
+  for (y=0; y < x; ++y)
+    lut[y] = colcnt[y].rgb;
+  ncolors = y;
+  for (lutsiz = degas[id].c ; y < 16; ++y)
+    lut[y] = 0x0F0;
+  y = ncolors;
+
+  bits = img->pix.bits;
+
+  /* Degas signature */
+  *bits++ = degas[id].id >> 8;
+  *bits++ = degas[id].id;
+
+  /* Copy palette */
+  for (y=0; y<lutsiz; ++y) {
+    const uint_t col = lut[ y ];
+
+    if ( (col & 0xFFF) != col ) {
+      dmsg(ctx,  "#%d/%d %x\n",y,lutsiz, col);
+    }
+
+    assert( (col & 0xFFF) == col );
+    *bits++ = col >> 8;
+    *bits++ = col;
+  }
+  if (!y)
+    *bits++ = 0xF, *bits++ = 0xFF, ++y;
+  for (; y<16; ++y) {
+    *bits++ = 0;
+    *bits++ = 0;
+  }
+
+  assert( bits == (img->pix.bits + 34) );
+
+  /* Slot to sorted index */
+  dmsg(ctx, "Reverse LUT\n");
+  for (y=i=0; y < ncolors; ++y) {
+    const int rgb = lut[y], k = cs.slot[rgb];
+    assert( (rgb & 0xFFF) == rgb );
+    assert( k < ncolors );
+    order[k] = y;
+    i |= k != y;
+  }
+
+  /* Pixels were blitted with slots. Remap them in place unless slots
+   * are already sorted. */
+  if (i)
+    remap_rows(bits, img->pix.w, img->pix.h, log2plans, order);
+
+  return img;
+
+too_many:
+  emsg(ctx, "too many colors -- more than %d -- %s\n", lutmax, png->path);
+  goto error;
+
+png_error:
+  /* reported by mypng_error() */
+error:
+  myimg_free(&img);
+  return 0;
+}
+
+/*
+ * RLE coding: code: 00..7f copy code+1 byte [1..128]
+ *                   80..ff fill next byte 257-code times [2..129]
+ */
+
+/* Byte x of a bitplane row: rows are 16-bit words every bpt bytes. */
+#define PLAN_BYTE(R,X,BPT) (R)[((X)>>1)*(BPT)+((X)&1)]
+
+static int
+enc_copy(uint8_t * d, const uint8_t * s, int x, int l, int bpt)
+{
+  const uint8_t * const d0 = d;
+  while (l > 0) {
+    int n = l, i;
+    if (n > 128) n = 128;
+    l -= n;
+    if (d0) {
+      assert( n >= 1 && n <= 128 );
+      d[0] = n-1;
+      if (bpt == 2)
+	memcpy(d+1,s+x,n);
+      else
+	for (i=0; i<n; ++i)
+	  d[1+i] = PLAN_BYTE(s,x+i,bpt);
+    }
+    d += 1+n;
+    x += n;
+  }
+  return d-d0;
+}
+
+static int
+enc_fill(uint8_t * d, const uint8_t v, int l)
+{
+  const uint8_t * const d0 = d;
+  while (l >= 2) {
+    int n = l;
+    if (n > 129)
+      /* GB: Ensure at least 2 bytes remaining for the last pass. */
+      n = 129 - (n==130);
+    l -= n;
+    if (d0) {
+      assert( n >= 2 && n <= 129 );
+      d[0] = 257 - n;
+      d[1] = v;
+    }
+    d += 2;
+  }
+  assert(l == 0);
+  return d-d0;
+}
+
+/* Repeat mask of a bitplane row: bit x is set when byte x equals
+ * byte x+1. Bytes are compared in place in the interleaved picture;
+ * an even byte x is followed by the next byte in memory, an odd one
+ * by the first byte of the next word of the same plan (bpt-1 bytes
+ * away). The last byte never repeats. len is at most 80 bytes.
+ */
+static void
+pcx_row_eq(uint64_t eq[2], const uint8_t * row, int len, int bpt)
+{
+  /* Readable span from row[0] to the last byte of this plan. */
+  const int span = (len>>1)*bpt - bpt + 2;
+  uint16_t e1[12], eb[12];		/* compare with +1 and +bpt-1 */
+  int p = 0, x;
+
+#ifdef __SSE2__
+  for (; p+15+bpt-1 < span; p += 16) {
+    const __m128i v = _mm_loadu_si128((const __m128i *)(row+p));
+    e1[p>>4] = _mm_movemask_epi8(
+      _mm_cmpeq_epi8(v, _mm_loadu_si128((const __m128i *)(row+p+1))));
+    eb[p>>4] = _mm_movemask_epi8(
+      _mm_cmpeq_epi8(v, _mm_loadu_si128((const __m128i *)(row+p+bpt-1))));
+  }
+#endif
+  for (; p < span; p += 16) {
+    int i, m1 = 0, mb = 0;
+    for (i=0; i<16 && p+i < span; ++i) {
+      m1 |= (p+i+1 < span && row[p+i] == row[p+i+1]) << i;
+      mb |= (p+i+bpt-1 < span && row[p+i] == row[p+i+bpt-1]) << i;
+    }
+    e1[p>>4] = m1;
+    eb[p>>4] = mb;
+  }
+
+  eq[0] = eq[1] = 0;
+  if (bpt == 2) {
+    /* Single plan: the row is contiguous, both masks agree. */
+    for (p=0; p<span; p += 16)
+      eq[p>>6] |= (uint64_t) e1[p>>4] << (p&63);
+  } else {
+    for (x=0, p=0; x<len; x += 2, p += bpt) {
+      eq[x>>6] |= (uint64_t) ((e1[p>>4] >> (p&15)) & 1) << (x&63);
+      eq[x>>6] |= (uint64_t) ((eb[(p+1)>>4] >> ((p+1)&15)) & 1) << ((x+1)&63);
+    }
+  }
+  x = len-1;
+  eq[x>>6] &= ~((uint64_t)1 << (x&63));
+}
+
+/* Next bit at or after i that differs from inv, len if none. */
+static inline int
+bit_next(const uint64_t eq[2], int i, int len, uint64_t inv)
+{
+  while (i < len) {
+    const uint64_t w = (eq[i>>6] ^ inv) >> (i&63);
+    if (w) {
+#ifdef __GNUC__
+      i += __builtin_ctzll(w);
+#else
+      uint64_t b;
+      for (b=w; !(b&1); b >>= 1) ++i;
+#endif
+      return i < len ? i : len;
+    }
+    i = (i|63)+1;
+  }
+  return len;
+}
+
+/* PackBits encode one plan of a scanline straight from the
+ * interleaved picture: row points to the first byte of the plan,
+ * bpt is the number of bytes per 16-pixels tile (2, 4 or 8). With
+ * dst==NULL only the encoded size is computed.
+ */
+static int
+pcx_encode_row(uint8_t * dst, const uint8_t * row, int len, int bpt)
+{
+  uint64_t eq[2];
+  int i, j, o;
+
+  assert(row);
+  assert(len > 0 && len <= 80);
+
+  pcx_row_eq(eq, row, len, bpt);
+
+  for (i=j=o=0; ; ) {
+    /* Greedy: any pair starts a repeat. */
+    const int r = bit_next(eq, i, len, 0);
+    int k;
+    if (r == len)
+      break;
+    k = bit_next(eq, r, len, ~(uint64_t)0) + 1;
+    if (r > o)
+      j += enc_copy(dst?dst+j:0, row, o, r-o, bpt);
+    j += enc_fill(dst?dst+j:0, PLAN_BYTE(row,r,bpt), k-r);
+    o = i = k;
+  }
+  j += enc_copy(dst?dst+j:0, row, o, len-o, bpt);
+
+  return j;
+}
+
+/* Shortest PackBits encoding of one plan of a scanline (same
+ * arguments as pcx_encode_row). f[j] is the minimal size of the
+ * first j bytes; the last code is either a copy of 1..128 bytes or a
+ * fill of 2..129 bytes. As f[] never decreases the longest possible
+ * fill is always the best one.
+ */
+static int
+pcx_encode_opt(uint8_t * dst, const uint8_t * row, int len, int bpt)
+{
+  uint64_t eq[2];
+  int16_t f[81];
+  uint8_t run[81], lit[81], cut[81];
+  int i, j, k = 0, m = 0;
+
+  assert(row);
+  assert(len > 0 && len <= 80);
+
+  pcx_row_eq(eq, row, len, bpt);
+
+  f[0] = 0;
+  for (j=1; j<=len; ++j) {
+    /* run[j]: number of equal bytes ending at byte j-1 */
+    run[j] = (j >= 2 && ((eq[(j-2)>>6] >> ((j-2)&63)) & 1))
+      ? run[j-1]+1 : 1;
+    f[j] = 0x7fff;
+    if (run[j] >= 2) {
+      const int l = run[j] > 129 ? 129 : run[j];
+      f[j] = f[j-l] + 2;
+      cut[j] = l; lit[j] = 0;
+    }
+    /* Lines are shorter than 128 bytes: a copy can start anywhere
+     * before j, the best start k minimizes f[k]-k. */
+    if (f[j-1] - (j-1) <= m)
+      m = f[j-1] - (j-1), k = j-1;
+    if (m + 1 + j < f[j]) {
+      f[j] = m + 1 + j;
+      cut[j] = j-k; lit[j] = 1;
+    }
+  }
+
+  if (dst) {
+    /* Walk back to mark code starts, then emit forward. */
+    uint8_t beg[81];
+    for (j=len, i=0; j>0; j -= cut[j])
+      beg[i++] = j;
+    for (j=0; --i >= 0; j = beg[i]) {
+      const int l = beg[i]-j;
+      if (lit[beg[i]])
+	enc_copy(dst+f[j], row, j, l, bpt);
+      else
+	enc_fill(dst+f[j], PLAN_BYTE(row,j,bpt), l);
+    }
+  }
+
+  return f[len];
+}
+
+/* Encode with the selected RLE method (size only if dst is NULL). */
+static int
+pcx_encode(const pngtopi1_ctx * ctx,
+	   uint8_t * dst, const uint8_t * row, int len, int bpt)
+{
+  return ctx->opt.rle
+    ? pcx_encode_opt(dst, row, len, bpt)
+    : pcx_encode_row(dst, row, len, bpt);
+}
+
+/* RLE encode all the bitplanes of a picture (without header). With
+ * dst==NULL only the size is computed. Greedy encoding of alternate
+ * pairs and single bytes grows 4/3, dst must hold twice the raw size.
+ */
+static int pcx_encode_bits(const pngtopi1_ctx * ctx,
+			   uint8_t * dst, const uint8_t * bits,
+			   int w, int h, int d)
+{
+  const int bpr = (w>>4) << (d+1);	/* bytes per row */
+  const int off = 2 << d;		/* offset to next word in plan */
+  int y, z, n = 0;
+
+  for (y=0; y<h; ++y, bits += bpr)
+    for (z=0; z<(1<<d); ++z)
+      n += pcx_encode(ctx, dst?dst+n:0, bits + (z<<1), bpr >> d, off);
+  return n;
+}
+
+/* Size of the PC file save_as_pcx() would write, without writing. */
+static int pcx_size(const pngtopi1_ctx * ctx, const mypix_t * pic)
+{
+  return 34 + pcx_encode_bits(ctx, 0, pic->bits+34, pic->w, pic->h, pic->d);
+}
+
+#ifdef DEBUG
+
+static void
+print_buffer(const pngtopi1_ctx * ctx,
+	     const uint8_t * b, int n, const char * label)
+{
+  const int l = strlen(label);
+  char s[64];
+  int i, j;
+
+  /* One message per line of 16 bytes */
+  for (i=0; i<n; i += 16) {
+    for (j=0; j<16 && i+j<n; ++j)
+      sprintf(s+3*j, " %02x", b[i+j]);
+    if (!i)
+      dmsg(ctx, "%s:%s\n", label, s);
+    else
+      dmsg(ctx, "%*s%s\n", l+1, "", s);
+  }
+}
+
+static int
+rle_decode(uint8_t * d, int dl, const uint8_t * s, int sl)
+{
+  int i,j;
+
+  for (i=j=0; i<sl && j<dl; ) {
+    int c = s[i++];
+    if (c < 128) {
+      /* Copy c+1 byte */
+      if (j+c+1 > dl) {
+	return -1;
+      }
+      for (++c; c; --c)
+	d[j++] = s[i++];
+    } else {
+      /* Fill 257-c times next byte */
+      const uint8_t v = s[i++];
+      if (j+257-c > dl) {
+	return -1;
+      }
+      for (c=257-c; --c >= 0;)
+	d[j++] = v;
+    }
+  }
+  assert( i <= sl );
+  assert( j <= dl );
+  return j;
+}
+
+#endif
+
+/* ----------------------------------------------------------------------
+ * PC palette order
+ *
+ * The RLE size of a plan only depends on which colors have their bit
+ * set in it: a truth table of 4 or 16 bits. A table and its
+ * complement have the same runs. Sizes are memoized per table and a
+ * local search over palette swaps keeps the cheapest order.
+ */
+
+typedef struct pcxord_s pcxord_t;
+struct pcxord_s {
+  uint8_t * idx;			/* chunky color indices (w*h) */
+  int32_t * memo;			/* size per truth table (-1) */
+  int w, h, nc;
+  const pngtopi1_ctx * ctx;
+};
+
+/* RLE size of a plan whose bits are given by truth table tt. */
+static int32_t pcxord_plan(pcxord_t * po, unsigned tt)
+{
+  const unsigned mask = (1u << po->nc) - 1;
+  const uint8_t * s = po->idx;
+  uint8_t line[80];
+  int32_t sum = 0;
+  int x, y;
+#ifdef __SSSE3__
+  uint8_t bit[16];
+  __m128i lut;
+#endif
+
+  if (tt & 1)
+    tt = ~tt & mask;
+  if (po->memo[tt>>1] >= 0)
+    return po->memo[tt>>1];
+
+#ifdef __SSSE3__
+  for (x=0; x<16; ++x)
+    bit[x] = -(tt >> x & 1);
+  lut = _mm_loadu_si128((const __m128i *) bit);
+#endif
+
+  for (y=0; y<po->h; ++y) {
+    x = 0;
+#ifdef __SSSE3__
+    /* Reverse 16 pixels so that movemask bit 15 is the left one. */
+    for (; x < po->w>>3; x += 2, s += 16) {
+      const __m128i rev =
+	_mm_setr_epi8(15,14,13,12,11,10,9,8,7,6,5,4,3,2,1,0);
+      const __m128i v = _mm_shuffle_epi8(
+	_mm_loadu_si128((const __m128i *) s), rev);
+      const int m = _mm_movemask_epi8(_mm_shuffle_epi8(lut, v));
+      line[x] = m >> 8;
+      line[x+1] = m;
+    }
+#endif
+    for (; x < po->w>>3; ++x, s += 8) {
+      int i, b = 0;
+      for (i=0; i<8; ++i)
+	b = b << 1 | (tt >> s[i] & 1);
+      line[x] = b;
+    }
+    sum += pcx_encode(po->ctx, 0, line, po->w>>3, 2);
+  }
+  return po->memo[tt>>1] = sum;
+}
+
+/* Total RLE size with color c moved to index perm[c]. */
+static int32_t pcxord_cost(pcxord_t * po, const uint8_t * perm, int nplans)
+{
+  int32_t sum = 0;
+  int c, z;
+
+  for (z=0; z<nplans; ++z) {
+    unsigned tt = 0;
+    for (c=0; c<po->nc; ++c)
+      tt |= (perm[c] >> z & 1) << c;
+    sum += pcxord_plan(po, tt);
+  }
+  return sum;
+}
+
+/* Swap colors until no swap makes it smaller. */
+static int32_t pcxord_climb(pcxord_t * po, uint8_t * perm, int nplans,
+			    int pin0, int32_t best)
+{
+  int a, b, again;
+
+  do {
+    again = 0;
+    for (a=pin0; a<po->nc; ++a)
+      for (b=a+1; b<po->nc; ++b) {
+	int32_t cost;
+	uint8_t t = perm[a]; perm[a] = perm[b]; perm[b] = t;
+	cost = pcxord_cost(po, perm, nplans);
+	if (cost < best)
+	  best = cost, again = 1;
+	else
+	  t = perm[a], perm[a] = perm[b], perm[b] = t;
+      }
+  } while (again);
+  return best;
+}
+
+/* Search the palette order of a PI1/PI2 picture for the smallest PC
+ * output: color c goes to index order[c]. The picture is not
+ * changed. Returns the number of bytes saved, -1 on error.
+ */
+static int32_t pcx_order(pngtopi1_ctx * ctx, const mypix_t * pic, int pin0,
+			 uint8_t * order)
+{
+  const int nplans = 1 << pic->d, bpl = (pic->w >> 3) << pic->d;
+  const uint8_t * const bits = pic->bits+34;
+  uint8_t perm[16], best[16];
+  pcxord_t po;
+  int32_t cost0, cost, kcost;
+  uint32_t seed = 0x1234567;
+  int c, y, k;
+
+  assert( pic->d == 1 || pic->d == 2 );
+
+  po.w = pic->w; po.h = pic->h; po.nc = 1 << nplans; po.ctx = ctx;
+  po.idx = mf_malloc(ctx, po.w * po.h);
+  po.memo = mf_malloc(ctx, sizeof(*po.memo) << (po.nc-1));
+  if (!po.idx || !po.memo) {
+    free(po.idx); free(po.memo);
+    return -1;
+  }
+  memset(po.memo, -1, sizeof(*po.memo) << (po.nc-1));
+  for (y=0; y<po.h; ++y)
+    p2c_idx(po.idx + y*po.w, bits + y*bpl, po.w, pic->d);
+
+  for (c=0; c<po.nc; ++c)
+    perm[c] = c;
+  cost0 = pcxord_cost(&po, perm, nplans);
+  cost = pcxord_climb(&po, perm, nplans, pin0, cost0);
+  memcpy(best, perm, sizeof(perm));
+
+  /* Kick the best order with a couple of random swaps and climb
+   * again. */
+  for (k=0; k < 8*(po.nc-pin0); ++k) {
+    memcpy(perm, best, sizeof(perm));
+    for (c=0; c<2; ++c) {
+      int a, b;
+      seed = seed * 1103515245 + 12345; a = pin0 + (seed>>16) % (po.nc-pin0);
+      seed = seed * 1103515245 + 12345; b = pin0 + (seed>>16) % (po.nc-pin0);
+      y = perm[a]; perm[a] = perm[b]; perm[b] = y;
+    }
+    kcost = pcxord_climb(&po, perm, nplans, pin0,
+			 pcxord_cost(&po, perm, nplans));
+    if (kcost < cost) {
+      cost = kcost;
+      memcpy(best, perm, sizeof(perm));
+    }
+  }
+  free(po.idx);
+  free(po.memo);
+
+  if (cost == cost0)
+    dmsg(ctx, "pcx palette: order kept\n");
+  memcpy(order, best, po.nc);
+  return cost0 - cost;
+}
+
+/* Move color c of a PI1/PI2 picture to index order[c]. The picture
+ * is unchanged, only indices are permuted.
+ */
+static void pcx_permute(mypix_t * pic, const uint8_t * order)
+{
+  const int nc = 1 << (1 << pic->d);
+  uint8_t pal[32];
+  int c;
+
+  memcpy(pal, pic->bits+2, nc*2);
+  for (c=0; c<nc; ++c) {
+    pic->bits[2+order[c]*2] = pal[c*2];
+    pic->bits[3+order[c]*2] = pal[c*2+1];
+  }
+  remap_rows(pic->bits+34, pic->w, pic->h, pic->d, order);
+}
+
+static int save_as_pcx(pngtopi1_ctx * ctx, mypix_t * pic)
+{
+  const int bpr = (pic->w>>4) << (pic->d+1); /* bytes per row */
+  const int off = 2 << pic->d;	     /* offset to next word in plan */
+  int y,z;
+
+  uint8_t rle[128];
+  const uint8_t * pix = pic->bits+34;
+
+  /* Write header */
+  pic->type = PCX;
+  pic->magic[1] = 'C';
+  pic->bits[0] = DEGAS_PC1 >> 8;
+  if (-1 == out_write(ctx, pic->bits, 34))
+    return -1;
+
+  /* RLE encode each plan of each line into rle[] */
+
+  /* For each line */
+  for (y=0; y<pic->h; ++y, pix += bpr) {
+    /* For each plan */
+    for (z=0; z<(1<<pic->d); ++z) {
+      const uint8_t * row = pix + (z<<1);
+      const int l = pcx_encode(ctx, rle, row, bpr >> pic->d, off);
+
+#ifdef DEBUG
+      if (1) {
+	uint8_t raw[80], xxx[80];
+	int x;
+	int lx = rle_decode(xxx, 80, rle, l);
+	print_buffer(ctx, rle, l, "ENC");
+	print_buffer(ctx, xxx, lx, "DEC");
+	for (x=0; x<bpr>>pic->d; ++x)
+	  raw[x] = PLAN_BYTE(row,x,off);
+	assert(lx == bpr >> pic->d) ;
+	assert(!memcmp(raw,xxx,lx));
+      }
+#endif
+      if (-1 == out_write(ctx, rle,l))
+	return -1;
+    }
+  }
+  return 0;
+}
+
+static int save_as_pix(pngtopi1_ctx * ctx, mypix_t * pic)
+{
+  const int l = pic->h * ( (pic->w>>4) << (pic->d+1) );
+
+  assert( l==32000 );
+  pic->type = PIX;
+  pic->magic[1] = 'I';
+  pic->bits[0] = DEGAS_PI1 >> 8;
+  return out_write(ctx, pic->bits, 34+l);
+}
+
+static int save_pix_as(pngtopi1_ctx * ctx, mypix_t * pix, int type)
+{
+  assert( pix );
+
+  if ( -1 == ((type == PCX)
+	      ? save_as_pcx(ctx,pix)
+	      : save_as_pix(ctx,pix)) )
+    return -1;
+
+  out_info(ctx, pix->type, degas + (2 - pix->d)*2, 0);
+  return 0;
+}
+
+/* ----------------------------------------------------------------------
+ * Bitplane scanline source
+ *
+ * The PNG writer pulls the scanlines one at a time, either from
+ * bitplanes (a picture or a PI input) or straight from the RLE data
+ * of a PC input, decoding only one line at a time.
+ **/
+
+typedef struct linesrc_s linesrc_t;
+struct linesrc_s {
+  const struct degasfmt_s * fmt;	/* picture format */
+  const uint8_t * bits;			/* bitplanes (or 0) */
+  const uint8_t *beg, *rle, *end;	/* else the RLE data */
+  int err;				/* set on read error */
+  const pngtopi1_ctx * ctx;		/* messages */
+  const char * path;			/* input name */
+  uint8_t line[160];			/* current scanline */
+};
+
+/* PNG type, depth and palette for a Degas picture. */
+typedef struct pnglay_s pnglay_t;
+struct pnglay_s {
+  int type, depth, n;			/* color type, bit depth, PLTE size */
+  int identity;				/* indices are kept as is */
+  uint8_t map[16];			/* Degas index to PNG value */
+  png_color lut[16];			/* PLTE */
+};
+
+/* Get the next scanline (y in order).
+ * @retval 0 on error
+ */
+static const uint8_t * linesrc_get(linesrc_t * ls, int y)
+{
+  const int bpl = (ls->fmt->w >> 3) << ls->fmt->d;
+
+  if (ls->bits)
+    return ls->bits + y * bpl;
+
+  if (rle_read_line(ls->ctx, ls->line, &ls->rle, ls->end,
+		    ls->fmt->w, ls->fmt->d, y, ls->path)) {
+    ls->err = 1;
+    return 0;
+  }
+  return ls->line;
+}
+
+/* Set the zlib and filter parameters of a PNG compression preset.
+ *
+ * Degas pictures are at most 32000 bytes of 1, 2 or 4 bits palette
+ * indices with long runs: filters seldom help and a full 32K window
+ * covers the whole image.
+ */
+static void mypng_preset(png_structp png, int preset)
+{
+  switch (preset) {
+  case PZ_FAST:
+    png_set_filter(png, PNG_FILTER_TYPE_BASE, PNG_FILTER_NONE);
+    png_set_compression_level(png, Z_BEST_SPEED);
+    png_set_compression_strategy(png, Z_RLE);
+    png_set_compression_mem_level(png, 8);
+    png_set_compression_window_bits(png, 15);
+    break;
+  case PZ_SMALL:
+    png_set_filter(png, PNG_FILTER_TYPE_BASE, PNG_FILTER_NONE);
+    png_set_compression_level(png, Z_BEST_COMPRESSION);
+    png_set_compression_strategy(png, Z_DEFAULT_STRATEGY);
+    png_set_compression_mem_level(png, 9);
+    png_set_compression_window_bits(png, 15);
+    break;
+  default:
+    /* libpng defaults */
+    break;
+  }
+}
+
+/* Restart a scanline source from the first line. */
+static int linesrc_rewind(linesrc_t * ls)
+{
+  ls->rle = ls->beg;
+  return 0;
+}
+
+/* Bit mask of the color indices used by a bitplane scanline. */
+static unsigned used_colors(const uint8_t * row, int w, int d)
+{
+  const int nplans = 1 << d, nc = 1 << nplans;
+  const unsigned all = (1u << nc) - 1;
+  unsigned used = 0;
+  int x, c, z;
+
+  for (x=0; x<w && used != all; x += 16, row += nplans<<1)
+    for (c=0; c<nc; ++c) {
+      unsigned m = 0xFFFF;
+      for (z=0; z<nplans; ++z) {
+	const unsigned p = (row[z<<1] << 8) | row[(z<<1)+1];
+	m &= (c >> z & 1) ? p : ~p;
+      }
+      used |= (m != 0) << c;
+    }
+  return used;
+}
+
+/* Pack 8-bit values into a PNG row of 1, 2, 4 or 8 bits. */
+static void pack_row(uint8_t * dst, const uint8_t * src, int w, int depth)
+{
+  const int per = 8 / depth;
+  int x, i;
+
+  if (depth == 8) {
+    memcpy(dst, src, w);
+    return;
+  }
+  for (x=0; x<w; x += per) {
+    int v = 0;
+    for (i=0; i<per; ++i)
+      v = (v << depth) | src[x+i];
+    *dst++ = v;
+  }
+}
+
+/* Smallest PNG layout of a Degas picture.
+ *
+ * The used indices are collected from the bitplanes (a first pass
+ * over the scanline source). Indices with the same color are merged.
+ * A gray image is written as gray if its levels fit in a bit depth no
+ * larger than the palette one, this saves the PLTE.
+ *
+ * @retval -1 on error
+ */
+static int mypng_layout(pngtopi1_ctx * ctx, pnglay_t * lay,
+			const uint8_t * hd, linesrc_t * ls)
+{
+  const struct degasfmt_s * const fmt = ls->fmt;
+  unsigned used = 0;
+  int y, i, j, gray = 1, gd;
+
+  lay->identity = 1;
+  if (fmt->d == 0) {
+    /* Monochrome: already the smallest. */
+    lay->type = PNG_COLOR_TYPE_GRAY;
+    lay->depth = 1;
+    lay->n = 0;
+    return 0;
+  }
+
+  for (y=0; y<fmt->h; ++y) {
+    const uint8_t * row = linesrc_get(ls, y);
+    if (!row)
+      return -1;
+    used |= used_colors(row, fmt->w, fmt->d);
+  }
+  if (-1 == linesrc_rewind(ls))
+    return -1;
+
+  /* Unique colors of used indices in index order. */
+  lay->n = 0;
+  for (i=0; i<fmt->c; ++i) {
+    const uint16_t st_rgb = (hd[2+(i<<1)] << 8) | hd[3+(i<<1)];
+    png_color col;
+
+    lay->map[i] = 0;
+    if (!(used >> i & 1))
+      continue;
+    col.red   = ctx->col_4to8[15 & (st_rgb>>8)];
+    col.green = ctx->col_4to8[15 & (st_rgb>>4)];
+    col.blue  = ctx->col_4to8[15 & (st_rgb>>0)];
+    for (j=0; j<lay->n && memcmp(&lay->lut[j], &col, sizeof(col)); ++j)
+      ;
+    if (j == lay->n)
+      lay->lut[lay->n++] = col;
+    lay->map[i] = j;
+    gray &= col.red == col.green && col.green == col.blue;
+  }
+  lay->depth = lay->n <= 2 ? 1 : lay->n <= 4 ? 2 : 4;
+  lay->type = PNG_COLOR_TYPE_PALETTE;
+
+  if (gray) {
+    /* Smallest depth that has all the gray levels. */
+    for (gd=1; gd<8; gd <<= 1) {
+      const int step = 255 / ((1 << gd) - 1);
+      for (j=0; j<lay->n && !(lay->lut[j].red % step); ++j)
+	;
+      if (j == lay->n)
+	break;
+    }
+    if (gd <= lay->depth) {
+      const int step = 255 / ((1 << gd) - 1);
+      lay->type = PNG_COLOR_TYPE_GRAY;
+      lay->depth = gd;
+      for (i=0; i<fmt->c; ++i)
+	lay->map[i] = lay->lut[lay->map[i]].red / step;
+    }
+  }
+
+  if (lay->depth != 1 << fmt->d)
+    lay->identity = 0;
+  for (i=0; i<fmt->c; ++i)
+    if ((used >> i & 1) && lay->map[i] != i)
+      lay->identity = 0;
+
+  dmsg(ctx, "png layout: %s/%d colors:%d used:%04x%s\n",
+       mypng_typestr(ctx, lay->type), lay->depth, lay->n, used,
+       lay->identity ? " (identity)" : "");
+  return 0;
+}
+
+/* Convert a bitplane scanline to a PNG row (dst or row itself). */
+static const png_byte * mypng_row(png_byte * dst, const uint8_t * row,
+				  const pnglay_t * lay,
+				  const struct degasfmt_s * fmt)
+{
+  png_byte idx[640];
+  int x;
+
+  assert( fmt->w <= 640 );
+  if (fmt->d == 0)
+    /* Single bitplan is a 1-bit gray row */
+    return row;
+  if (lay->identity)
+    p2c_row(dst, row, fmt->w, fmt->d);
+  else {
+    p2c_idx(idx, row, fmt->w, fmt->d);
+    for (x=0; x<fmt->w; ++x)
+      idx[x] = lay->map[idx[x]];
+    pack_row(dst, idx, fmt->w, lay->depth);
+  }
+  return dst;
+}
+
+/* Set the PNG header and palette from a layout then write all the
+ * rows of a scanline source. libpng errors longjmp.
+ *
+ * @return PNG color type
+ * @retval -1 on error
+ */
+static int mypng_write_rows(png_structp png_ptr, png_infop info_ptr,
+			    const pnglay_t * lay, linesrc_t * ls)
+{
+  const struct degasfmt_s * const fmt = ls->fmt;
+  const png_byte * row;
+  png_byte tmp[160];
+  int y;
+
+  png_set_IHDR(png_ptr, info_ptr, fmt->w, fmt->h,
+	       lay->depth, lay->type, PNG_INTERLACE_NONE,
+	       PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+  if (lay->type == PNG_COLOR_TYPE_PALETTE)
+    png_set_PLTE(png_ptr, info_ptr, lay->lut, lay->n);
+  png_write_info(png_ptr, info_ptr);
+
+  for (y=0; y<fmt->h; y++) {
+    if (row = linesrc_get(ls, y), !row)
+      return -1;
+    png_write_row(png_ptr, mypng_row(tmp, row, lay, fmt));
+  }
+  return lay->type;
+}
+
+/* ----------------------------------------------------------------------
+ * PNG smallest encoding search (--png-max)
+ *
+ * Every combination of filter, zlib level, strategy and memory level
+ * is encoded into memory by a few threads. Only the smallest PNG is
+ * written.
+ **/
+
+typedef struct pngtrial_s pngtrial_t;
+struct pngtrial_s {
+  int filter, level, strategy, memlevel; /* parameters */
+  int type;				/* PNG color type or -1 */
+  uint8_t * data;			/* encoded PNG */
+  size_t len, max;
+};
+
+typedef struct pngmax_s pngmax_t;
+struct pngmax_s {
+  const pnglay_t * lay;			/* PNG layout */
+  linesrc_t * ls;			/* in memory: thread safe */
+  pngtrial_t * trials;
+  int ntrials, next;			/* next: first trial to run */
+  pthread_mutex_t lock;			/* protects next */
+};
+
+static void mypng_mem_write(png_structp png, png_bytep data, png_size_t len)
+{
+  pngtrial_t * const t = png_get_io_ptr(png);
+
+  if (t->len + len > t->max) {
+    size_t max = (t->len + len) * 2;
+    uint8_t * d = realloc(t->data, max);
+    if (!d)
+      png_error(png, "alloc error");
+    t->data = d;
+    t->max = max;
+  }
+  memcpy(t->data + t->len, data, len);
+  t->len += len;
+}
+
+static void mypng_mem_flush(png_structp png)
+{
+  (void) png;
+}
+
+/* Encode one trial into memory (t->type is -1 on error). */
+static void mypng_trial(pngtrial_t * t, const pnglay_t * lay, linesrc_t * ls)
+{
+  png_structp png_ptr;
+  png_infop info_ptr = 0;
+
+  t->type = -1;
+  png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, 0,
+				    mypng_error, mypng_warning);
+  if (!png_ptr)
+    return;
+  if (info_ptr = png_create_info_struct(png_ptr), !info_ptr)
+    goto exit;
+  if (setjmp(png_jmpbuf(png_ptr))) {
+    t->type = -1;
+    goto exit;
+  }
+  png_set_write_fn(png_ptr, t, mypng_mem_write, mypng_mem_flush);
+  png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, t->filter);
+  png_set_compression_level(png_ptr, t->level);
+  png_set_compression_strategy(png_ptr, t->strategy);
+  png_set_compression_mem_level(png_ptr, t->memlevel);
+  png_set_compression_window_bits(png_ptr, 15);
+  t->type = mypng_write_rows(png_ptr, info_ptr, lay, ls);
+  if (t->type != -1)
+    png_write_end(png_ptr, 0);
+exit:
+  png_destroy_write_struct(&png_ptr, info_ptr ? &info_ptr : 0);
+}
+
+static void * mypng_max_thread(void * arg)
+{
+  pngmax_t * const pm = arg;
+
+  for (;;) {
+    int i;
+    pthread_mutex_lock(&pm->lock);
+    i = pm->next++;
+    pthread_mutex_unlock(&pm->lock);
+    if (i >= pm->ntrials)
+      break;
+    mypng_trial(pm->trials+i, pm->lay, pm->ls);
+  }
+  return 0;
+}
+
+static int save_png_max(pngtopi1_ctx * ctx, const uint8_t * hd,
+			linesrc_t * ls)
+{
+  static const int filters[] = {
+    PNG_FILTER_NONE, PNG_FILTER_SUB, PNG_FILTER_UP,
+    PNG_FILTER_AVG, PNG_FILTER_PAETH, PNG_ALL_FILTERS
+  };
+  static const int strategies[][2] = {
+    /* strategy, first level */
+    { Z_DEFAULT_STRATEGY, 6 }, { Z_FILTERED, 6 },
+    { Z_RLE, 9 }, { Z_HUFFMAN_ONLY, 9 }
+  };
+  const int bpl = (ls->fmt->w >> 3) << ls->fmt->d;
+  pngtrial_t trials[6*(4+4+1+1)*2], *best = 0;
+  pnglay_t lay;
+  pngmax_t pm;
+  pthread_t tid[16];
+  uint8_t * bits = 0;
+  linesrc_t mem;
+  int ret = -1, n = 0, nthreads = 1, i, j, l, m;
+
+  /* All trials read the same lines: get them in memory first. */
+  if (!ls->bits) {
+    if (bits = mf_malloc(ctx, 32000), !bits)
+      return -1;
+    for (i=0; i<ls->fmt->h; ++i) {
+      const uint8_t * row = linesrc_get(ls, i);
+      if (!row)
+	goto exit;
+      memcpy(bits + i*bpl, row, bpl);
+    }
+  }
+  memset(&mem, 0, offsetof(linesrc_t, line));
+  mem.fmt = ls->fmt;
+  mem.bits = bits ? bits : ls->bits;
+  mem.ctx = ctx;
+  mem.path = ls->path;
+  if (-1 == mypng_layout(ctx, &lay, hd, &mem))
+    goto exit;
+
+  memset(trials, 0, sizeof(trials));
+  for (i=0; i<6; ++i)
+    for (j=0; j<4; ++j)
+      for (l=strategies[j][1]; l<=9; ++l)
+	for (m=8; m<=9; ++m) {
+	  pngtrial_t * const t = trials + n++;
+	  assert( n <= (int)(sizeof(trials)/sizeof(*trials)) );
+	  t->filter = filters[i];
+	  t->strategy = strategies[j][0];
+	  t->level = l;
+	  t->memlevel = m;
+	}
+
+  /* Run the trials, one thread per CPU including this one. */
+#ifdef _SC_NPROCESSORS_ONLN
+  nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  if (nthreads < 1) nthreads = 1;
+  if (nthreads > 16) nthreads = 16;
+  pm.lay = &lay;
+  pm.ls = &mem;
+  pm.trials = trials;
+  pm.ntrials = n;
+  pm.next = 0;
+  pthread_mutex_init(&pm.lock, 0);
+  for (i=1; i<nthreads; ++i)
+    if (pthread_create(tid+i, 0, mypng_max_thread, &pm))
+      break;				/* fewer threads is fine */
+  mypng_max_thread(&pm);
+  for (j=1; j<i; ++j)
+    pthread_join(tid[j], 0);
+  pthread_mutex_destroy(&pm.lock);
+
+  for (i=0; i<n; ++i)
+    if (trials[i].type != -1 && (!best || trials[i].len < best->len))
+      best = trials + i;
+  if (!best) {
+    emsg(ctx, "libpng error -- %s\n", ctx->name);
+    goto exit;
+  }
+  amsg(ctx, "png-max: %d trials, best filter:%d level:%d strategy:%d mem:%d\n",
+       n, best->filter, best->level, best->strategy, best->memlevel);
+
+  if (-1 == out_write(ctx, best->data, best->len))
+    goto exit;
+  out_info(ctx, PNG, ls->fmt, mypng_typestr(ctx, best->type));
+  ret = 0;
+
+exit:
+  for (i=0; i<n; ++i)
+    free(trials[i].data);
+  free(bits);
+  return ret;
+}
+
+/* ----------------------------------------------------------------------
+ * Built-in PNG writer (--png-writer)
+ *
+ * Degas pictures only give three small PNG layouts. This writer
+ * builds the whole file in one buffer without libpng. Rows are not
+ * filtered. The IDAT is deflated by zlib, or encoded here with the
+ * fixed Huffman codes and matches one byte back (runs) or one row up,
+ * or simply stored.
+ **/
+
+static uint32_t crc_tab[8][256];	/* CRC-32 slice-by-8 tables */
+static uint16_t fh_code[288];		/* fixed Huffman (bit reversed) */
+static uint8_t	fh_bits[288];
+static pthread_once_t builtin_once = PTHREAD_ONCE_INIT;
+
+static const uint16_t len_base[29] = {
+  3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,
+  35,43,51,59,67,83,99,115,131,163,195,227,258
+};
+static const uint8_t len_extra[29] = {
+  0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0
+};
+static const uint16_t dist_base[16] = {
+  1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193
+};
+static const uint8_t dist_extra[16] = {
+  0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6
+};
+
+static unsigned bit_reverse(unsigned v, int n)
+{
+  unsigned r = 0;
+  while (n--)
+    r = (r << 1) | (v & 1), v >>= 1;
+  return r;
+}
+
+static void builtin_init(void)
+{
+  uint32_t c;
+  int i, j;
+
+  for (i=0; i<256; ++i) {
+    for (c=i, j=0; j<8; ++j)
+      c = (c >> 1) ^ (0xEDB88320u & -(c & 1));
+    crc_tab[0][i] = c;
+  }
+  for (i=0; i<256; ++i)
+    for (j=1; j<8; ++j)
+      crc_tab[j][i] = (crc_tab[j-1][i] >> 8)
+	^ crc_tab[0][crc_tab[j-1][i] & 255];
+
+  for (i=0; i<288; ++i) {
+    if (i < 144)
+      fh_bits[i] = 8, c = 0x30 + i;
+    else if (i < 256)
+      fh_bits[i] = 9, c = 0x190 + i - 144;
+    else if (i < 280)
+      fh_bits[i] = 7, c = i - 256;
+    else
+      fh_bits[i] = 8, c = 0xC0 + i - 280;
+    fh_code[i] = bit_reverse(c, fh_bits[i]);
+  }
+}
+
+/* CRC-32 (slice-by-8) */
+static uint32_t crc32_s8(uint32_t crc, const uint8_t * p, size_t n)
+{
+  crc = ~crc;
+  for (; n >= 8; n -= 8, p += 8) {
+    const uint32_t a = crc
+      ^ (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24);
+    const uint32_t b =
+      p[4] | p[5] << 8 | p[6] << 16 | (uint32_t) p[7] << 24;
+    crc = crc_tab[7][a & 255] ^ crc_tab[6][a >> 8 & 255]
+      ^ crc_tab[5][a >> 16 & 255] ^ crc_tab[4][a >> 24]
+      ^ crc_tab[3][b & 255] ^ crc_tab[2][b >> 8 & 255]
+      ^ crc_tab[1][b >> 16 & 255] ^ crc_tab[0][b >> 24];
+  }
+  while (n--)
+    crc = (crc >> 8) ^ crc_tab[0][(crc ^ *p++) & 255];
+  return ~crc;
+}
+
+static uint32_t adler32_s(const uint8_t * p, size_t n)
+{
+  uint32_t a = 1, b = 0;
+  while (n) {
+    size_t k = n < 5552 ? n : 5552;	/* no overflow before modulo */
+    n -= k;
+    while (k--)
+      a += *p++, b += a;
+    a %= 65521;
+    b %= 65521;
+  }
+  return b << 16 | a;
+}
+
+static uint8_t * put_be32(uint8_t * p, uint32_t v)
+{
+  p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+  return p+4;
+}
+
+/* LSB first bit writer */
+typedef struct bitw_s bitw_t;
+struct bitw_s {
+  uint8_t * p;
+  uint64_t acc;
+  int n;
+};
+
+static inline void bw_put(bitw_t * bw, uint32_t v, int n)
+{
+  bw->acc |= (uint64_t) v << bw->n;
+  for (bw->n += n; bw->n >= 8; bw->n -= 8, bw->acc >>= 8)
+    *bw->p++ = bw->acc;
+}
+
+/* One fixed Huffman block with matches at distance 1 and up. */
+static uint8_t * deflate_fixed(uint8_t * dst, const uint8_t * src,
+			       int len, int up)
+{
+  bitw_t bw = { dst, 0, 0 };
+  int i = 0;
+
+  bw_put(&bw, 1 | 1 << 1, 3);		/* BFINAL, fixed Huffman */
+  while (i < len) {
+    const int max = len-i < 258 ? len-i : 258;
+    int best = 0, dist = 0, k, s;
+
+    if (i >= 1) {
+      for (k=0; k<max && src[i+k] == src[i+k-1]; ++k)
+	;
+      best = k, dist = 1;
+    }
+    if (i >= up) {
+      for (k=0; k<max && src[i+k] == src[i+k-up]; ++k)
+	;
+      if (k > best)
+	best = k, dist = up;
+    }
+
+    if (best < 3) {
+      bw_put(&bw, fh_code[src[i]], fh_bits[src[i]]);
+      ++i;
+      continue;
+    }
+    for (s=28; len_base[s] > best; --s)
+      ;
+    bw_put(&bw, fh_code[257+s], fh_bits[257+s]);
+    bw_put(&bw, best - len_base[s], len_extra[s]);
+    for (s=15; dist_base[s] > dist; --s)
+      ;
+    bw_put(&bw, bit_reverse(s, 5), 5);
+    bw_put(&bw, dist - dist_base[s], dist_extra[s]);
+    i += best;
+  }
+  bw_put(&bw, fh_code[256], fh_bits[256]);
+  if (bw.n)
+    *bw.p++ = bw.acc;
+  return bw.p;
+}
+
+static uint8_t * deflate_stored(uint8_t * dst, const uint8_t * src, int len)
+{
+  do {
+    const int n = len < 65535 ? len : 65535;
+    *dst++ = n == len;			/* BFINAL, stored */
+    dst[0] = n; dst[1] = n >> 8;
+    dst[2] = ~n; dst[3] = ~n >> 8;
+    memcpy(dst+4, src, n);
+    dst += 4+n; src += n; len -= n;
+  } while (len > 0);
+  return dst;
+}
+
+static uint8_t * deflate_zlib(uint8_t * dst, size_t max,
+			      const uint8_t * src, int len, int preset)
+{
+  int level = Z_DEFAULT_COMPRESSION, strategy = Z_DEFAULT_STRATEGY, mem = 8;
+  z_stream zs;
+
+  switch (preset) {
+  case PZ_FAST:  level = Z_BEST_SPEED; strategy = Z_RLE; break;
+  case PZ_SMALL: level = Z_BEST_COMPRESSION; mem = 9; break;
+  }
+  memset(&zs, 0, sizeof(zs));
+  if (Z_OK != deflateInit2(&zs, level, Z_DEFLATED, 15, mem, strategy))
+    return 0;
+  zs.next_in = (Bytef *) src;
+  zs.avail_in = len;
+  zs.next_out = dst;
+  zs.avail_out = max;
+  if (Z_STREAM_END != deflate(&zs, Z_FINISH)) {
+    deflateEnd(&zs);
+    return 0;
+  }
+  deflateEnd(&zs);
+  return dst + zs.total_out;
+}
+
+/* Set length and CRC of a chunk (type at p+4, data at p+8). */
+static uint8_t * chunk_close(uint8_t * p, size_t len)
+{
+  put_be32(p, len);
+  return put_be32(p+8+len, crc32_s8(0, p+4, len+4));
+}
+
+static int save_png_builtin(pngtopi1_ctx * ctx, const pnglay_t * lay,
+			    linesrc_t * ls)
+{
+  const struct degasfmt_s * const fmt = ls->fmt;
+  const int stride = (fmt->w * lay->depth + 7) >> 3;
+  const int rawlen = fmt->h * (stride+1);
+  const size_t max = 256 + 3*16 + rawlen + (rawlen >> 3)
+    + 5 * (rawlen/65535 + 1);
+  uint8_t *raw = 0, *buf = 0, *p, *z;
+  png_byte tmp[160];
+  int ret = -1, y, i;
+
+  pthread_once(&builtin_once, builtin_init);
+
+  if (raw = mf_malloc(ctx, rawlen), !raw)
+    goto exit;
+  if (buf = mf_malloc(ctx, max), !buf)
+    goto exit;
+
+  /* Unfiltered rows */
+  for (y=0, p=raw; y<fmt->h; ++y, p += stride+1) {
+    const uint8_t * row = linesrc_get(ls, y);
+    if (!row)
+      goto exit;
+    p[0] = PNG_FILTER_VALUE_NONE;
+    memcpy(p+1, mypng_row(tmp, row, lay, fmt), stride);
+  }
+
+  memcpy(buf, "\x89PNG\r\n\x1a\n", 8);
+  p = buf+8;
+
+  memcpy(p+4, "IHDR", 4);
+  put_be32(p+8, fmt->w);
+  put_be32(p+12, fmt->h);
+  p[16] = lay->depth;
+  p[17] = lay->type;
+  p[18] = p[19] = p[20] = 0;		/* deflate, adaptive, no interlace */
+  p = chunk_close(p, 13);
+
+  if (lay->type == PNG_COLOR_TYPE_PALETTE) {
+    memcpy(p+4, "PLTE", 4);
+    for (i=0; i<lay->n; ++i) {
+      p[8+3*i] = lay->lut[i].red;
+      p[9+3*i] = lay->lut[i].green;
+      p[10+3*i] = lay->lut[i].blue;
+    }
+    p = chunk_close(p, 3*lay->n);
+  }
+
+  memcpy(p+4, "IDAT", 4);
+  z = p+8;
+  if (ctx->opt.pngw == PW_ZLIB)
+    z = deflate_zlib(z, buf + max - 12 - z, raw, rawlen, ctx->opt.pngz);
+  else {
+    *z++ = 0x78; *z++ = 0x01;		/* deflate 32K, fastest */
+    z = ctx->opt.pngw == PW_FIXED
+      ? deflate_fixed(z, raw, rawlen, stride+1)
+      : deflate_stored(z, raw, rawlen);
+    z = put_be32(z, adler32_s(raw, rawlen));
+  }
+  if (!z) {
+    emsg(ctx, "deflate error -- %s\n", ctx->name);
+    goto exit;
+  }
+  assert( z + 12 <= buf + max );
+  p = chunk_close(p, z-p-8);
+
+  memcpy(p+4, "IEND", 4);
+  p = chunk_close(p, 0);
+
+  if (-1 == out_write(ctx, buf, p-buf))
+    goto exit;
+  out_info(ctx, PNG, fmt, mypng_typestr(ctx, lay->type));
+  ret = 0;
+
+exit:
+  free(buf);
+  free(raw);
+  return ret;
+}
+
+/* Write a PNG with libpng. Never inlined (setjmp), so the other
+ * writers are dispatched by save_png_rows(). */
+static int save_png_libpng(pngtopi1_ctx * ctx, const pnglay_t * lay,
+			   linesrc_t * ls)
+{
+  png_structp png_ptr = 0;
+  png_infop info_ptr = 0;
+  int png_type;
+
+  volatile int ret=-1;			/* set after setjmp() */
+
+  png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, ctx,
+				    mypng_error, mypng_warning);
+  if (!png_ptr)
+    goto png_error;
+
+  if (info_ptr = png_create_info_struct(png_ptr), !info_ptr)
+    goto png_error;
+
+  if (setjmp(png_jmpbuf(png_ptr)))
+    goto error;
+
+  png_set_write_fn(png_ptr, ctx, mypng_out_write, mypng_out_flush);
+  mypng_preset(png_ptr, ctx->opt.pngz);
+
+  png_type = mypng_write_rows(png_ptr, info_ptr, lay, ls);
+  if (png_type == -1)
+    goto error;
+
+  png_write_end(png_ptr, 0);
+  out_info(ctx, PNG, ls->fmt, mypng_typestr(ctx, png_type));
+  ret = 0;
+
+error:
+  if (png_ptr)
+    png_destroy_write_struct(&png_ptr, info_ptr ? &info_ptr : 0);
+
+  return ret;
+
+png_error:
+  syserror(ctx, ctx->name, "libpng error");
+  goto error;
+}
+
+/* Write a PNG from a Degas header (palette) and a scanline source. */
+static int save_png_rows(pngtopi1_ctx * ctx, const uint8_t * hd,
+			 linesrc_t * ls)
+{
+  pnglay_t lay;
+
+  if (ctx->opt.pngz == PZ_MAX)
+    return save_png_max(ctx, hd, ls);
+
+  if (-1 == mypng_layout(ctx, &lay, hd, ls))
+    return -1;
+
+  return ctx->opt.pngw != PW_LIBPNG
+    ? save_png_builtin(ctx, &lay, ls)
+    : save_png_libpng(ctx, &lay, ls)
+    ;
+}
+
+static int save_png_as(pngtopi1_ctx * ctx, mypix_t * pix)
+{
+  linesrc_t ls;
+
+  assert( pix->magic[2] >= '1' && pix->magic[2] <= '3' );
+  memset(&ls, 0, offsetof(linesrc_t, line));
+  ls.fmt = degas + ((pix->magic[2]-'1') << 1);
+  ls.bits = pix->bits+34;
+  ls.ctx = ctx;
+  ls.path = pix->path;
+  return save_png_rows(ctx, pix->bits, &ls);
+}
+
+/* Check the Degas header of the input.
+ *
+ * @retval 0..5 index in degas[]
+ * @retval -1   not a Degas image
+ */
+static int degas_probe(pngtopi1_ctx * ctx, const uint8_t * data, size_t len)
+{
+  int id, i = 6;
+
+  if (len >= 34) {
+    id = (data[0]<<8) | data[1];
+    for (i=0; i<6 && degas[i].id != id; ++i)
+      ;
+  }
+  if (i == 6 || len < degas[i].minsz)
+    /* Let the generic path report it. */
+    return -1;
+  imsg(ctx, "input: \"%s\" %dx%dx%d (%s)\n",
+       basename((char *)ctx->name), degas[i].w, degas[i].h, 1<<degas[i].d,
+       degas[i].name);
+  return i;
+}
+
+/* Convert a Degas image to PNG one scanline at a time.
+ *
+ * @retval -1     not a Degas image (use the generic path)
+ * @retval E_OK   on success
+ * @retval E_INP  on input error
+ * @retval E_OUT  on output error
+ */
+static int degas_to_png(pngtopi1_ctx * ctx, const uint8_t * data, size_t len)
+{
+  linesrc_t ls;
+  int i;
+
+  i = degas_probe(ctx, data, len);
+  if (i < 0)
+    return -1;
+
+  memset(&ls, 0, offsetof(linesrc_t, line));
+  ls.fmt = degas + i;
+  ls.ctx = ctx;
+  ls.path = ctx->name;
+  if (ls.fmt->rle) {
+    ls.beg = ls.rle = data + 34;
+    ls.end = data + len;
+  } else
+    ls.bits = data + 34;
+
+  return save_png_rows(ctx, data, &ls)
+    ? (ls.err ? E_INP : E_OUT)
+    : E_OK;
+}
+
+/* ----------------------------------------------------------------------
+ * Degas transcoding
+ *
+ * PI? to PC? and back only changes the container. The bitplanes are
+ * RLE encoded or decoded line by line from the input buffer and the
+ * header is kept with its magic word patched. The colors are never
+ * looked at.
+ **/
+
+/* Transcode a Degas image to PI? or PC? (type). With --auto-smallest
+ * the RLE version is kept only if it is smaller.
+ *
+ * @retval -1     not a Degas image (use the generic path)
+ * @retval E_OK   on success
+ * @retval E_INP  on input error
+ * @retval E_OUT  on output error
+ */
+static int transcode_degas(pngtopi1_ctx * ctx, const uint8_t * data,
+			   size_t len, int type)
+{
+  const struct degasfmt_s * fmt;
+  uint8_t *dec = 0, *enc = 0, hd[34];
+  const uint8_t *raw, *out;
+  int ecode = E_INP, bpl, olen, i, y;
+
+  i = degas_probe(ctx, data, len);
+  if (i < 0)
+    return -1;
+  fmt = degas + i;
+  bpl = (fmt->w >> 3) << fmt->d;
+
+  /* Get the raw bitplanes, decoded or straight from the input. */
+  raw = data+34;
+  if (fmt->rle) {
+    const uint8_t * src = data+34;
+    if (dec = mf_malloc(ctx, 32000), !dec)
+      goto exit;
+    for (y=0; y<fmt->h; ++y)
+      if (rle_read_line(ctx, dec+y*bpl, &src, data+len,
+			fmt->w, fmt->d, y, ctx->name))
+	goto exit;
+    raw = dec;
+  }
+
+  out = raw;
+  olen = 32000;
+  if (type == PCX) {
+    if (enc = mf_malloc(ctx, 2*32000), !enc)
+      goto exit;
+    olen = pcx_encode_bits(ctx, enc, raw, fmt->w, fmt->h, fmt->d);
+    if (ctx->opt.smallest)
+      amsg(ctx, "pcx estimated size: %d (pix: 32034)\n", 34+olen);
+    if (!ctx->opt.smallest || olen < 32000)
+      out = enc;
+    else {
+      type = PIX;
+      olen = 32000;
+    }
+  }
+
+  /* Same header, patched magic word */
+  memcpy(hd, data, 34);
+  hd[0] = (type == PCX ? DEGAS_PC1 : DEGAS_PI1) >> 8;
+  fmt = degas + (i & ~1) + (type == PCX);
+
+  ecode = E_OUT;
+  if (-1 == out_write(ctx, hd, 34) || -1 == out_write(ctx, out, olen))
+    goto exit;
+  out_info(ctx, type, fmt, 0);
+  ecode = E_OK;
+
+exit:
+  free(enc);
+  free(dec);
+  return ecode;
+}
+
+static int save_img_as(pngtopi1_ctx * ctx, myimg_t * img, int type)
+{
+  mypix_t * const pix = &img->pix;
+
+  assert( img );
+  assert( pix->type == PIX || pix->type == PCX );
+
+  dmsg(ctx, "save_img_as("
+       "%dx%dx%d/%s,"
+       "%s(%d)\n",
+       pix->w,pix->w,1<<(1<<pix->d),type_names[pix->type],
+       type_names[type],type);
+
+  if ( type == PXX )
+    /* Input was a PNG and no operation was specified. Use the
+     * suggested type (if any) or default to PIX. */
+    type = ctx->opt.suggest != PXX ? ctx->opt.suggest : PIX;
+
+  if (type == PCX) {
+    uint8_t order[16];
+    int32_t saved = 0;
+
+    /* The palette order is searched first but only applied if the
+     * RLE version is kept. */
+    if (ctx->opt.pal && pix->d > 0
+	&& -1 == (saved = pcx_order(ctx, pix, ctx->opt.pal > 1, order)))
+      return -1;
+
+    if (ctx->opt.smallest) {
+      /* Keep the RLE version only if it is smaller. */
+      const int size = pcx_size(ctx, pix) - saved;
+      amsg(ctx, "pcx estimated size: %d (pix: 32034)\n", size);
+      if (size >= 32034)
+	type = PIX;
+    }
+
+    if (type == PCX && saved > 0) {
+      imsg(ctx, "pcx palette: reordered, %d bytes saved\n", (int) saved);
+      pcx_permute(pix, order);
+    }
+  }
+
+  return type == PNG
+    ? save_png_as(ctx, pix)
+    : save_pix_as(ctx, pix, type)
+    ;
+}
+
+/* ----------------------------------------------------------------------
+ * Library entry points
+ **/
+
+int pngtopi1_init(pngtopi1_ctx * ctx, const pngtopi1_opt * opt)
+{
+  static const pngtopi1_opt defaults;
+
+  memset(ctx, 0, sizeof(*ctx));
+  ctx->opt = opt ? *opt : defaults;
+  opt = &ctx->opt;
+
+  switch (opt->col) {
+  case CQ_TBD:
+  case CQ_STF|CQ_000: case CQ_STF|CQ_LBR: case CQ_STF|CQ_FDR:
+  case CQ_STE|CQ_000: case CQ_STE|CQ_LBR: case CQ_STE|CQ_FDR:
+    break;
+  default:
+    return E_ARG;
+  }
+  if (opt->out > PNG || opt->suggest > PNG || opt->pal > 2
+      || opt->pngz > PZ_MAX || opt->pngw > PW_STORED)
+    return E_ARG;
+
+  set_color_mode(ctx, opt->col);
+  return E_OK;
+}
+
+void pngtopi1_free(void * data)
+{
+  free(data);
+}
+
+int pngtopi1_convert(pngtopi1_ctx * ctx, const char * name,
+		     const void * data, size_t len, pngtopi1_out * out)
+{
+  const uint8_t * const inp = data;
+  int ecode, itype, otype = ctx->opt.out;
+  myimg_t *src = 0, *cvt = 0;
+
+  ctx->name = name ? name : "<memory>";
+  ctx->res = out;
+  ctx->own = !out->data;
+  if (ctx->own)
+    out->max = 0;
+  out->len = 0;
+  out->type = PXX;
+  out->err[0] = 0;
+
+  /* Degas to Degas is a container conversion, unless the palette
+   * has to be reordered. */
+  if ((otype == PIX || otype == PCX) && !ctx->opt.pal && !ctx->opt.chk) {
+    ecode = transcode_degas(ctx, inp, len, otype);
+    if (ecode != -1)
+      goto exit;
+  }
+
+  /* Degas to PNG is streamed. */
+  if ((otype == PXX || otype == PNG) && !ctx->opt.chk) {
+    ecode = degas_to_png(ctx, inp, len);
+    if (ecode != -1)
+      goto exit;
+  }
+
+  /* ----------------------------------------
+     Read the input image.
+     ---------------------------------------- */
+
+  ecode = E_INP;
+  if (src = read_img(ctx, inp, len), !src)
+    goto exit;
+  itype = src->png.type;
+
+  amsg(ctx, "Loaded as %dx%dx%d(%d) %s/%s(%d) \"%s\"\n",
+       src->png.w, src->png.h, src->png.d,
+       src->png.c, src->png.magic,
+       type_names[itype&3], itype,
+       src->png.path );
+  assert( !memcmp(src->png.magic, type_names[itype&3], 2) );
+
+  if (itype == PNG) {
+    mypng_t * const png = &src->png;
+
+    assert( !memcmp(src->png.magic,"PNG",3) );
+    imsg(ctx, "input: \"%s\" %dx%dx%d PNG-%s(%d)\n",
+	 basename((char *)png->path), png->w, png->h, 1<<png->d,
+	 mypng_typestr(ctx, png->t), png->t);
+    if (cvt = mypix_from_png(ctx, png), !cvt) {
+      /* A broken PNG is an input error, not an unsupported one. */
+      ecode = png->err ? E_INP : E_PNG;
+      goto exit;
+    }
+
+  }
+  else {
+    mypix_t * const pix = &src->pix;
+
+    imsg(ctx, "input: \"%s\" %dx%dx%d (%s)\n",
+	 basename((char *)pix->path), pix->w, pix->h, 1<<pix->d, pix->magic);
+
+    /* Default operation for P[IC][123] is PNG */
+    if (otype == PXX)
+      otype = PNG;
+  }
+
+  if (ctx->opt.chk) {
+    amsg(ctx, "check only, nothing saved\n");
+    ecode = E_OK;
+    goto exit;
+  }
+
+  ecode = E_OUT;
+  if ( save_img_as(ctx, cvt?cvt:src, otype) )
+    goto exit;
+
+  ecode = E_OK;
+exit:
+  myimg_free(&src);
+  myimg_free(&cvt);
+
+  if (ecode == E_OK && out->len > out->max) {
+    emsg(ctx, "output buffer too small (%u/%u) -- %s\n",
+	 (uint_t) out->max, (uint_t) out->len, ctx->name);
+    ecode = E_OUT;
+  }
+  if (ecode != E_OK)
+    out->type = PXX;
+  if (ecode != E_OK && ctx->own) {
+    free(out->data);
+    out->data = 0;
+    out->max = out->len = 0;
+  } else if (ecode != E_OK && out->len <= out->max)
+    out->len = 0;
+  ctx->res = 0;
+  return ecode;
+}
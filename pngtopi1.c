@@ -57,12 +57,11 @@
 
 #endif /* HAVE_CONFIG_H */
 
-/* ---------------------------------------------------------------------- */
-
 
 /* std */
 #include <assert.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -70,112 +69,86 @@
 #include "ctype.h"
 #include <getopt.h>
 #include <errno.h>
+#include <pthread.h>
 
 #ifdef __MINGW32__
 #include <libgen.h> /* GB: mingw does not have basename() in string.h  */
+#define flockfile(F) _lock_file(F)
+#define funlockfile(F) _unlock_file(F)
+#else
+#include <unistd.h>			/* sysconf() */
+#include <sched.h>			/* CPU_SET() */
 #endif
 
-/* libpng */
-#include <png.h>
+/* libpngtopi1 */
+#include "pngtopi1.h"
 
 /* ---------------------------------------------------------------------- */
 
 /* Error codes */
 enum {
-  E_OK, E_ERR, E_ARG, E_INT, E_INP, E_OUT, E_PNG
+  E_OK  = PNGTOPI1_E_OK,
+  E_ERR = PNGTOPI1_E_ERR,
+  E_ARG = PNGTOPI1_E_ARG,
+  E_INT = PNGTOPI1_E_INT,
+  E_INP = PNGTOPI1_E_INP,
+  E_OUT = PNGTOPI1_E_OUT,
+  E_PNG = PNGTOPI1_E_PNG
 };
 
-/* For opt_pcx */
+/* Image types */
 enum {
-  PXX = 0, PIX = 1, PCX = 2, PNG = 3
+  PXX = PNGTOPI1_PXX, PIX = PNGTOPI1_PIX,
+  PCX = PNGTOPI1_PCX, PNG = PNGTOPI1_PNG
 };
 
 static const char type_names[][4] = {
   "P??","PI?","PC?","PNG"
 };
 
-/* RGB conversion methods (bit-field) */
+/* PNG compression presets (--png-speed) */
 enum {
-  CQ_TBD = 0,		       /* ..00 | To be determined           */
-  CQ_STF = 1,		       /* ..01 | Using 3 bits per component */
-  CQ_STE = 2,		       /* ..10 | Using 4 bits per component */
+  PZ_DEFAULT = PNGTOPI1_PZ_DEFAULT,
+  PZ_FAST    = PNGTOPI1_PZ_FAST,
+  PZ_SMALL   = PNGTOPI1_PZ_SMALL,
+  PZ_MAX     = PNGTOPI1_PZ_MAX
+};
 
-  CQ_000 = 4,		       /* 01.. | 0 fill                     */
-  CQ_LBR = 8,		       /* 10.. | Left bit replication       */
-  CQ_FDR = 12		       /* 11.. | Full dynamic range         */
+/* PNG writers (--png-writer) */
+enum {
+  PW_LIBPNG = PNGTOPI1_PW_LIBPNG,
+  PW_ZLIB   = PNGTOPI1_PW_ZLIB,
+  PW_FIXED  = PNGTOPI1_PW_FIXED,
+  PW_STORED = PNGTOPI1_PW_STORED
 };
 
-/* Degas magic word */
+/* RGB conversion methods (--color) */
 enum {
-  DEGAS_PI1 = 0x0000,
-  DEGAS_PI2 = 0x0001,
-  DEGAS_PI3 = 0x0002,
-  DEGAS_PC1 = DEGAS_PI1+0x8000,
-  DEGAS_PC2 = DEGAS_PI2+0x8000,
-  DEGAS_PC3 = DEGAS_PI3+0x8000
+  CQ_STF = PNGTOPI1_CQ_STF,
+  CQ_STE = PNGTOPI1_CQ_STE,
+  CQ_000 = PNGTOPI1_CQ_000,
+  CQ_LBR = PNGTOPI1_CQ_LBR,
+  CQ_FDR = PNGTOPI1_CQ_FDR
 };
 
-static uint8_t opt_col = CQ_TBD; /* mask used color bits (default TBD)*/
-static uint8_t opt_out = PXX;	 /* {PXX,PIX,PCX,PNG} (see enum) */
 static	int8_t opt_bla = 0;	 /* blah blah level */
+static uint8_t opt_bat = 0;	 /* batch: all arguments are inputs */
+static uint8_t opt_aff = 0;	 /* pin batch workers to CPUs */
 static uint8_t opt_dir = 0;	 /* same dir versus current dir */
+static int opt_jobs = 1;	 /* batch workers (0: one per CPU) */
+static int opt_fly = 0;		 /* batch pipeline images (0: off) */
 
 typedef unsigned int uint_t;
 
-typedef struct myfile_s myfile_t;
-struct myfile_s {
-  FILE * file;
-  char * path;
-  int err;
-  ssize_t len;
-  uint8_t mode, report;
-};
-
-#define IMG_COMMON				\
-  int8_t magic[4];				\
-  char * path;					\
-  int	 type, w, h, d, c
-
-typedef struct mypng_s mypng_t;
-struct mypng_s {
-  IMG_COMMON;
-
-  int i, t, f, z, p;
-  png_structp png;
-  png_colorp  lut;
-  int	      lutsz;
-  png_infop   inf;
-  png_bytep  *rows;
-};
-
-typedef struct mypix_s mypix_t;
-struct mypix_s {
-  IMG_COMMON;
-  uint8_t bits[32034];		 /* uncompressed (include header)  */
-};
-
-typedef union myimg_s myimg_t;
-union myimg_s {
-  mypix_t pix;
-  mypng_t png;
-};
-
-typedef struct colorcount_s colcnt_t;
-struct colorcount_s {
-  uint32_t rgb:12, cnt:20;		/* Is it legal ? */
-};
-static colcnt_t g_colcnt[0x1000];
-
-static const struct degasfmt_s {
-  const char name[4];
-  unsigned short  id, minsz,   w,  h, d, c,rle;
-} degas[6] = {
-  { "PI1", DEGAS_PI1, 32034, 320,200, 2,16, 0 },
-  { "PC1", DEGAS_PC1, 1634 , 320,200, 2,16, 1 },
-  { "PI2", DEGAS_PI2, 32034, 640,200, 1,4,  0 },
-  { "PC2", DEGAS_PC2, 839  , 640,200, 1,4,  1 },
-  { "PI3", DEGAS_PI3, 32034, 640,400, 0,0,  0 },
-  { "PC3", DEGAS_PC3, 854  , 640,400, 0,0,  1 },
+/* Pipeline job (--in-flight): the input is loaded and converted in
+ * memory, the output is saved by the pipeline writer. */
+typedef struct mfjob_s mfjob_t;
+struct mfjob_s {
+  char * ipath;
+  uint8_t * data;			/* input data (0: not loaded) */
+  size_t len;
+  pngtopi1_out out;			/* conversion output */
+  int state;				/* JOB_* */
 };
 
 /* ----------------------------------------------------------------------
@@ -184,10 +157,11 @@ static const struct degasfmt_s {
 
 static char *create_output_path(char * ipath, const char * ext);
 static int guess_type_from_path(char * path);
-static int save_img_as(myimg_t * img, char * path, int type);
-static int save_pix_as(mypix_t * pix, char * path, int type);
-static int save_png_as(mypix_t * pix, char * path);
-static myimg_t * mypix_from_file(myfile_t * const mf);
+static char * output_path(char * ipath, char * path,
+			  const pngtopi1_out * out);
+static int convert_file(pngtopi1_ctx * ctx, char * ipath, char * opath);
+static int convert_batch(pngtopi1_ctx * ctx, char ** inputs, int n,
+			 char * list);
 static void print_usage(int verbose);
 static void print_version(void);
 
@@ -253,10 +227,12 @@ static void wmsg(const char * fmt, ...)
   if (opt_bla >= 0) {
     va_list list;
     va_start(list, fmt);
+    flockfile(stderr);			/* one line per thread */
     fprintf(stderr,"%s: ",PROGRAM_NAME);
     vfprintf(stderr,fmt,list);
-    va_end(list);
     fflush(stderr);
+    funlockfile(stderr);
+    va_end(list);
   }
 }
 
@@ -267,10 +243,12 @@ static void emsg(const char * fmt, ...)
   if (opt_bla >= -1) {
     va_list list;
     va_start(list, fmt);
+    flockfile(stderr);
     fprintf(stderr,"%s: ",PROGRAM_NAME);
     vfprintf(stderr,fmt,list);
-    va_end(list);
     fflush(stderr);
+    funlockfile(stderr);
+    va_end(list);
   }
 }
 
@@ -283,17 +261,21 @@ static void syserror(const char * ipath, const char * alt)
     emsg("%s\n", estr);
 }
 
-static void notpng(const char * path)
-{
-  emsg("invalid image format -- %s\n", path);
-}
-
-static void pngerror(const char * path)
+/* Messages of the conversion library (filtered on opt_bla already) */
+static void lib_msg(void * cookie, int level, const char * msg)
 {
-  syserror(path,"libpng error");
+  (void) cookie;
+  if (level <= PNGTOPI1_M_WARN) {
+    flockfile(stderr);
+    fprintf(stderr,"%s: %s",PROGRAM_NAME,msg);
+    fflush(stderr);
+    funlockfile(stderr);
+  } else {
+    fputs(msg,stdout);
+    fflush(stdout);
+  }
 }
 
-
 /* ----------------------------------------------------------------------
  |
  | System functions (with error report)
@@ -328,1452 +310,903 @@ static char * mf_strdup(const char * s, int len_or_0)
   return d;
 }
 
-static int mf_close(myfile_t * const mf)
+/* Load a whole file in memory (to be freed). */
+static int load_file(char * path, uint8_t ** pdata, size_t * plen)
 {
-  assert( mf );
-
-  if (mf->file) {
-    if ( fclose(mf->file) ) {
-      mf->err = errno;
-      if (mf->report) syserror(mf->path,"close");
-      return -1;
-    }
-    mf->file = 0;
-    dmsg("C<%c> %u \"%s\"\n",
-	 "ARW+"[mf->mode], (uint_t)mf->len, mf->path);
-  }
-  return 0;
-}
+  FILE * f;
+  uint8_t * data = 0;
+  long len = -1;
+  int ecode = E_INP;
 
-static ssize_t mf_tell(myfile_t * const mf)
-{
-  ssize_t pos = ftell(mf->file);
-  if (pos == -1)
-    if (mf->report) syserror(mf->path, "tell error");
-  return pos;
-}
+  assert( path );
+  *pdata = 0;
+  *plen = 0;
 
-static ssize_t mf_seek(myfile_t * const mf, long offset, int whence)
-{
-  if ( fseek(mf->file, offset, whence) ) {
-    if (mf->report) syserror(mf->path, "seek error");
-    return -1;
+  if (f = fopen(path,"rb"), !f) {
+    syserror(path, "open error");
+    return E_INP;
   }
-  return 0;
-}
+  if (fseek(f, 0, SEEK_END) || (len = ftell(f)) == -1
+      || fseek(f, 0, SEEK_SET)) {
+    syserror(path, "seek error");
+    goto exit;
+  }
+  if (data = mf_malloc(len ? len : 1), !data) {
+    ecode = E_ERR;
+    goto exit;
+  }
+  if (fread(data, 1, len, f) != (size_t) len) {
+    syserror(path, "read error");
+    goto exit;
+  }
+  dmsg("O<R> %u \"%s\"\n", (uint_t)len, path);
+  *pdata = data;
+  *plen = len;
+  data = 0;
+  ecode = E_OK;
 
+exit:
+  free(data);
+  fclose(f);
+  return ecode;
+}
 
-static int mf_open(myfile_t * const mf, char * path, int mode)
+/* Write a whole file. */
+static int save_file(char * path, const void * data, size_t len)
 {
-  const char * modes[4] = { "ab", "rb", "wb", "rb+" };
+  FILE * f;
+  size_t n;
 
-  assert( mf );
   assert( path );
   assert( *path );
-  assert( mode == 1 || mode == 2 );
-
-  memset(mf,0,sizeof(*mf));
-  mf->report = 1;
-  mf->mode = mode & 3;
-  mf->path = path;
-  mf->file = fopen(path, modes[mode & 3]);
-  mf->err = errno;
-  if (!mf->file) {
-    if (mf->report) syserror(path, "open error");
+
+  errno = 0;
+  if (f = fopen(path,"wb"), !f) {
+    syserror(path, "open error");
     return -1;
   }
-
-  switch (mf->mode) {
-  case 1:
-    if (-1 == mf_seek(mf,0,SEEK_END) ||
-	-1 == (mf->len = mf_tell(mf))  ||
-	-1 == mf_seek(mf,0,SEEK_SET)) {
-      mf->report = 0;
-      mf_close(mf);
-      return -1;
-    }
-    break;
-  case 2:
-    mf->len = 0; break;
-  default:
-    abort();
+  n = fwrite(data, 1, len, f);
+  if (n != len) {
+    if (errno)
+      syserror(path, "write error");
+    else
+      emsg("uncompleted write (%u/%u) -- %s\n",
+	   (uint_t)n, (uint_t)len, path);
+    fclose(f);
+    return -1;
   }
-
-  dmsg("O<%c> %u \"%s\"\n",
-       "ARW+"[mf->mode], (uint_t)mf->len, mf->path);
-
+  if (fclose(f)) {
+    syserror(path,"close");
+    return -1;
+  }
+  dmsg("C<W> %u \"%s\"\n", (uint_t)len, path);
   return 0;
 }
 
-static ssize_t mf_read(myfile_t * const mf, void * data, ssize_t len)
+int main(int argc, char *argv[])
 {
-  ssize_t n;
-
-  assert( mf );
-  assert( mf->mode == 1 );
-  n = fread(data,1,len,mf->file);
-  if (n == -1) {
-    mf->err = errno;
-    if (mf->report)
-      syserror(mf->path, "read error");
-  } else {
-    /* dmsg("R<%c> +%u \"%s\"\n", */
-    /*      "ARW+"[mf->mode], (uint_t) n, mf->path); */
-    if (n != len) {
-      if (mf->report)
-	emsg("missing input data (%u/%u) -- %s\n\n",
-	     (uint_t)n, (uint_t)len, mf->path);
-      n = -1;
-    }
-  }
-  assert ( n == -1 || n == len );
-  return n;
-}
+  int ecode = E_OK;
+  char *ipath = 0, *opath = 0, *list = 0;
+  pngtopi1_ctx ctx;
+  pngtopi1_opt opt;
 
-static ssize_t mf_write(myfile_t * const mf, const void * data, ssize_t len)
-{
-  ssize_t n;
+  int option_index = 0, c;
+  static char me[] = PROGRAM_NAME;
 
-  assert( mf );
-  assert( mf->mode == 2 );
+  argv[0] = me;
+  memset(&opt, 0, sizeof(opt));		/* default options */
+  opterr = 0;				/* Report error */
+  optind = 1;				/* Where arguments start */
+  ecode = E_ARG;
 
-  errno = 0;
-  n = fwrite(data,1,len,mf->file);
-  if (n == -1) {
-    mf->err = errno;
-    if (mf->report)
-      syserror(mf->path, "write error");
-  } else {
-    mf->len += n;
-    /* dmsg("W<%c> +%u =%u \"%s\"\n", */
-    /*      "ARW+"[mf->mode], (uint_t) n, (uint_t) mf->len, mf->path); */
-    if (n != len) {
-      if (mf->report)
-	emsg("uncompleted write (%u/%u) -- %s\n",
-	     (uint_t)n, (uint_t)len, mf->path);
-      n = -1;
-    }
-  }
-  assert ( n == -1 || n == len );
-  return n;
-}
+  for (;;) {
+    static const char sopts[] = "hV" "vq" "c:ezraZpks:mw:" "dnbL:j:AI:";
+    static struct option lopts[] = {
+      {"help",	  no_argument,	    0, 'h'},
+      {"usage",	  no_argument,	    0, 'h'},
+      {"version", no_argument,	    0, 'V'},
+      /**/
+      {"verbose", no_argument,	    0, 'v'},
+      {"quiet",	  no_argument,	    0, 'q'},
+      /**/
+      {"color",	  required_argument,0, 'c'},
+      {"ste",	  no_argument,	    0, 'e'},
+      {"pcx",	  no_argument,	    0, 'z'},
+      {"pix",	  no_argument,	    0, 'r'},
+      {"auto-smallest",no_argument, 0, 'a'},
+      {"pcx-optimal",no_argument,   0, 'Z'},
+      {"pcx-palette",no_argument,   0, 'p'},
+      {"keep-color0",no_argument,   0, 'k'},
+      {"png-speed",required_argument,0,'s'},
+      {"png-max", no_argument,	    0, 'm'},
+      {"png-writer",required_argument,0,'w'},
+      /**/
+      {"same-dir",no_argument,	    0, 'd'},
+      {"check",	  no_argument,	    0, 'n'},
+      {"batch",	  no_argument,	    0, 'b'},
+      {"from-list",required_argument,0, 'L'},
+      {"jobs",	  required_argument,0, 'j'},
+      {"affinity",no_argument,	    0, 'A'},
+      {"in-flight",required_argument,0, 'I'},
+      /**/
+      {0, 0, 0, 0}
+    };
 
-/* ----------------------------------------------------------------------
- |
- | Color conversions
- |
- * ---------------------------------------------------------------------- */
+    /* getopt_long stores the option index here. */
 
-/* Table to convert 4 bits component to 8bits.
- *
- * Various method depending on:
- * - color component  depth STf:3 STe:4
- * - The left bit fill method (zero,replicated,full-range)
- */
-static uint8_t col_4to8[16];		/* X -> XX */
+    c = getopt_long(argc, argv, sopts, lopts, &option_index);
 
-/* Table to covert 8 bit color component to 4bit.
- *
- * Entries are (444) RGB outputs. The table is fill depending on the
- * color mode set.
- */
-static uint16_t rgb_8to4[256];
+    /* Detect the end of the options. */
+    if (c == -1)
+      break;
+    switch (c)
+    {
+    case 'h': print_usage(opt_bla); ecode = E_OK; goto exit;
+    case 'V': print_version(); ecode = E_OK; goto exit;
+      /**/
+    case 'v': opt_bla++; break;
+    case 'q': opt_bla--; break;
+      /**/
+    case 'c': {
+      int i;
+      static struct { char s[3], m; } modes[] = {
+	{ "3z", CQ_STF|CQ_000 },
+	{ "3r", CQ_STF|CQ_LBR },
+	{ "3f", CQ_STF|CQ_FDR },
+	{ "4z", CQ_STE|CQ_000 },
+	{ "4r", CQ_STE|CQ_LBR },
+	{ "4f", CQ_STE|CQ_FDR },
+      };
 
-/* The index of the table match the ST hardware RGB encoding.
- *
- *  STe for backward compatibility uses the bits #3,#7,#11 as the LSB
- *  of respectively green,blue,red component.
- */
+      for ( i=0; i<(int)(sizeof(modes)/sizeof(*modes)); ++i )
+	if ( ! strcasecmp(modes[i].s, optarg ) ) {
+	  opt.col = modes[i].m; i = -1; break;
+	}
+      if (i > 0) {
+	emsg("invalid argument for -c/--color -- `%s'\n",optarg);
+	goto exit;
+      }
+    } break;
+    case 'e': opt.col = CQ_STE|CQ_LBR; break;
 
-/* STf: Zero fill */
-static const uint8_t stf_zerofill[16] = {
-  0x00,0x20,0x40,0x60,0x80,0xA0,0xC0,0xE0,
-  0x00,0x20,0x40,0x60,0x80,0xA0,0xC0,0xE0
-};
+    case 's': {
+      int i;
+      static struct { char s[8]; uint8_t m; } modes[] = {
+	{ "fast",    PZ_FAST    },
+	{ "default", PZ_DEFAULT },
+	{ "small",   PZ_SMALL   },
+	{ "max",     PZ_MAX     },
+      };
 
-/* STf: Left bit replicated  */
-static const uint8_t stf_replicated[16] = {
-  0x00,0x24,0x49,0x6D,0x92,0xB6,0xDB,0xFF,
-  0x00,0x24,0x49,0x6D,0x92,0xB6,0xDB,0xFF
-};
+      for ( i=0; i<(int)(sizeof(modes)/sizeof(*modes)); ++i )
+	if ( ! strcasecmp(modes[i].s, optarg ) ) {
+	  opt.pngz = modes[i].m; i = -1; break;
+	}
+      if (i > 0) {
+	emsg("invalid argument for -s/--png-speed -- `%s'\n",optarg);
+	goto exit;
+      }
+    } break;
 
-/* Stf: Full range */
-static const uint8_t stf_fullrange[16] = {
-  0x00,0x24,0x48,0x6D,0x91,0xB6,0xDA,0xFF,
-  0x00,0x24,0x48,0x6D,0x91,0xB6,0xDA,0xFF
-};
+    case 'z':
+      if (opt.out == PXX || opt.out == PCX)
+	opt.out = PCX;
+      else {
+	emsg("option `-z' and `-r' are exclusive\n");
+	goto exit;
+      }
+      break;
 
-/* STe: Zero fill */
-static const uint8_t ste_zerofill[16] = {
-  0x00,0x20,0x40,0x60,0x80,0xA0,0xC0,0xE0,
-  0x10,0x30,0x50,0x70,0x90,0xB0,0xD0,0xF0
-};
+    case 'a':
+      if (opt.out == PXX || opt.out == PCX)
+	opt.out = PCX, opt.smallest = 1;
+      else {
+	emsg("option `-a' and `-r' are exclusive\n");
+	goto exit;
+      }
+      break;
 
-/* STe: Left bit replicated  */
-static const uint8_t ste_replicated[16] = {
-  0x00,0x22,0x44,0x66,0x88,0xAA,0xCC,0xEE,
-  0x11,0x33,0x55,0x77,0x99,0xBB,0xDD,0xFF
-};
+    case 'Z': opt.rle = 1; break;
+    case 'm': opt.pngz = PZ_MAX; break;
 
-#define ste_fullrange ste_replicated
+    case 'w': {
+      int i;
+      static struct { char s[8]; uint8_t m; } modes[] = {
+	{ "libpng", PW_LIBPNG },
+	{ "zlib",   PW_ZLIB   },
+	{ "fixed",  PW_FIXED  },
+	{ "stored", PW_STORED },
+      };
 
-/* Convert STe color component to standard order */
-static const uint8_t ste_to_std[16] = {
-  /* ste: 0 1 2 3 4 5 6 7 8 9 A B C D E F
-     std: 0 2 4 6 8 A C E 1 3 5 7 9 B D F */
-  0x0,0x2,0x4,0x6,0x8,0xA,0xC,0xE,
-  0x1,0x3,0x5,0x7,0x9,0xB,0xD,0xF
-};
+      for ( i=0; i<(int)(sizeof(modes)/sizeof(*modes)); ++i )
+	if ( ! strcasecmp(modes[i].s, optarg ) ) {
+	  opt.pngw = modes[i].m; i = -1; break;
+	}
+      if (i > 0) {
+	emsg("invalid argument for -w/--png-writer -- `%s'\n",optarg);
+	goto exit;
+      }
+    } break;
+    case 'p': opt.pal |= 1; break;
+    case 'k': opt.pal = 2; break;
+    case 'r': opt.out = PIX; break;
+      if (opt.out == PXX || opt.out == PIX)
+	opt.out = PIX;
+      else {
+	emsg("option `-z' and `-r' are exclusive\n");
+	goto exit;
+      }
+      break;
 
-/* Convert standard 4bit component to STe color component to */
+      /**/
+    case 'd': opt_dir = 1; break;
+    case 'n': opt.chk = 1; break;
+    case 'b': opt_bat = 1; break;
+    case 'L': opt_bat = 1; list = optarg; break;
+    case 'A': opt_aff = 1; break;
+    case 'j': {
+      char * end;
+      long v = strtol(optarg, &end, 10);
+      if (end == optarg || *end || v < 0 || v > 1024) {
+	emsg("invalid argument for -j/--jobs -- `%s'\n",optarg);
+	goto exit;
+      }
+      opt_jobs = v;
+    } break;
+    case 'I': {
+      char * end;
+      long v = strtol(optarg, &end, 10);
+      if (end == optarg || *end || v < 0 || v > 4096) {
+	emsg("invalid argument for -I/--in-flight -- `%s'\n",optarg);
+	goto exit;
+      }
+      opt_fly = v;
+    } break;
+    case 000: break;
+    case '?':
+      if (!opterr) {
+	if (optopt)
+	  emsg("unknown option -- `%c' (%d)\n",
+	       isgraph(optopt)?optopt:'.', optopt);
+	else
+	  emsg("unknown option -- `%s'\n", argv[optind-1]);
+      }
+      goto exit;
+      break;
 
-static const uint8_t std_to_ste[16] = {
-  /* std: 0 1 2 3 4 5 6 7 8 9 A B C D E F
-     ste: 0 8 1 9 2 A 3 B 4 C 5 D 6 E 7 F */
-  0x0,0x8,0x1,0x9,0x2,0xA,0x3,0xB,
-  0x4,0xC,0x5,0xD,0x6,0xE,0x7,0xF
-};
+    default:
+      emsg("unexpected option -- `%c' (%d)\n",
+	   isgraph(c)?c:'.', c);
+      ecode = E_INT;
+      goto exit;
+    }
+  }
 
-static void set_color_mode(int mode)
-{
-  const uint8_t * col_used;
-  int i;
-  static const char * lbf_names[] = {
-    "zero fill", "left bit replication", "full range"
-  };
-
-  switch(mode) {
-  default:
-    assert( !"unexpected color mode" );
-  case CQ_TBD:
-  case CQ_STF | CQ_LBR:
-    mode = CQ_STF | CQ_LBR;
-    col_used = stf_replicated;
-    break;
-
-  case CQ_STF | CQ_000:
-    col_used = stf_zerofill;
-    break;
-
-  case CQ_STF | CQ_FDR:
-    col_used = stf_fullrange;
-    break;
-
-  case CQ_STE | CQ_000:
-    col_used = ste_zerofill;
-    break;
-
-  case CQ_STE | CQ_LBR:
-    col_used = ste_replicated;
-    break;
-
-  case CQ_STE | CQ_FDR:
-    col_used = ste_fullrange;
-    break;
+  if (optind >= argc && !list) {
+    emsg("too few arguments. Try --help.\n");
+    goto exit;
   }
-  memcpy(col_4to8, col_used, 16);
-  opt_col = mode;
-  amsg("Using ST%s colors with %s\n",
-       (mode&3) == CQ_STF ? "":"e", lbf_names[ (mode>>2)-1 ]);
-
-  for ( i=0; i < 256; ++i ) {
-    const uint_t c = std_to_ste[i>>4];
-    rgb_8to4[i] = c|(c<<4)|(c<<8);
-    assert( (rgb_8to4[i] & 0xFFF) == rgb_8to4[i] );
+
+  if (!opt_bat) {
+    ipath = argv[optind++];
+    if (optind < argc)
+      opath = argv[optind++];
+    if (optind < argc) {
+      emsg("too many arguments. Try --help.\n");
+      goto exit;
+    }
   }
+
+  opt.verbose = opt_bla;
+  opt.msg = lib_msg;
+  ecode = pngtopi1_init(&ctx, &opt);
+  if (ecode)
+    goto exit;
+
+  if (!opt_bat)
+    ecode = convert_file(&ctx, ipath, opath);
+  else
+    ecode = convert_batch(&ctx, argv+optind, argc-optind, list);
+
+exit:
+  dmsg("%s: exit %d\n",PROGRAM_NAME,ecode);
+  return ecode;
 }
 
-static inline uint16_t rgb444(uint8_t r, uint8_t g, uint8_t b)
+/* Convert an input in memory. The output path (if any) suggests the
+ * output type of a PNG input. Returns E_* code.
+ */
+static int convert_data(pngtopi1_ctx * ctx, char * ipath, char * opath,
+			const void * data, size_t len, pngtopi1_out * out)
 {
-  return 0
-    | ( rgb_8to4[r] & 0xF00 )
-    | ( rgb_8to4[g] & 0x0F0 )
-    | ( rgb_8to4[b] & 0x00F )
-    ;
-}
+  const int guess_type = guess_type_from_path(opath);
+  dmsg("guessed type: %s(%d)\n",type_names[guess_type],guess_type);
 
-/* ----------------------------------------------------------------------
- |
- | Pixel functions.
- |
- * ---------------------------------------------------------------------- */
+  if (guess_type != PXX)
+    amsg("provided output suggests %s\n", type_names[guess_type]);
+  ctx->opt.suggest = guess_type;
 
+  memset(out, 0, sizeof(*out));
+  return pngtopi1_convert(ctx, ipath, data, len, out);
+}
 
-#define PXL_CHECK(D,T,C)			\
-  do {						\
-    assert ( png );				\
-    assert( (uint_t)x < (uint_t)png->w );	\
-    assert( (uint_t)y < (uint_t)png->h );	\
-    assert(png->d == (D));			\
-    assert(png->t == (T));			\
-    assert(png->c == (C));			\
-  } while (0)
+/* Save a conversion output to opath (0: automatic). Returns E_* code. */
+static int save_output(char * ipath, char * opath, const pngtopi1_out * out)
+{
+  int ecode = E_OUT;
+  char * path;
 
-#define LUT_CHECK(I)		 \
-  do {				 \
-    assert( png->lut );		 \
-    assert( (I) < png->lutsz );	 \
-  } while (0)
+  if (out->type == PXX)
+    return E_OK;			/* check only */
 
-typedef uint16_t (*get_f)(const mypng_t *, int, int);
+  if (path = output_path(ipath, opath, out), !path)
+    return E_OUT;
+  if (!save_file(path, out->data, out->len)) {
+    imsg("output: \"%s\" %dx%dx%d (%s) size:%d\n",
+	 path, out->w, out->h, out->colors, out->format, (int)out->len);
+    ecode = E_OK;
+  }
+  if (path != opath)
+    free(path);
+  return ecode;
+}
 
-static uint16_t get_st_pixel(const mypix_t * const pix, int x, int y)
+/* Convert one file (context must be initialized). Returns E_* code. */
+static int convert_file(pngtopi1_ctx * ctx, char * ipath, char * opath)
 {
-  const int w = ( pix->w + 15 ) & -16;
-  const int bytes_per_line = ( w << pix->d ) >> 3;
-  const int tile = x >> 4;
-  const int log2_bytes_per_tile = pix->d+1;
-  const int bitnum = ~x & 7;
-  const int nbplans = 1 << pix->d;
-  int col, p;
-
-  assert( (uint_t)x < (uint_t)pix->w );
-  assert( (uint_t)y < (uint_t)pix->h );
-
-  /* Using y as offset */
-  y *= bytes_per_line;			/* line offset */
-  y += tile << log2_bytes_per_tile;	/* tile offset */
-  y += ( x >> 3 ) & 1;			/* byte offset */
-  y += 34;				/* skip header */
-
-  for ( col = p = 0; p < nbplans; ++p, y += 2 )
-    col |= ( ( pix->bits[ y ] >> bitnum ) & 1 ) << p;
-  return col;
+  pngtopi1_out out;
+  uint8_t * data;
+  size_t len;
+  int ecode;
+
+  if (ecode = load_file(ipath, &data, &len), ecode)
+    return ecode;
+  ecode = convert_data(ctx, ipath, opath, data, len, &out);
+  free(data);
+  if (!ecode)
+    ecode = save_output(ipath, opath, &out);
+  pngtopi1_free(out.data);
+  return ecode;
 }
 
 /* ----------------------------------------------------------------------
- *  Gray scale methods
+ * Batch worker pool (-j)
+ *
+ * Each worker owns a range of the batch and converts from its front.
+ * Once empty it steals the back half of the largest range left.
+ * Conversions are independent: each worker has its own copy of the
+ * conversion context. Inputs that
+ * would get the same automatic output name are one work item, and
+ * are converted in order.
  **/
 
-static uint16_t get_gray1(const mypng_t * png, int x, int y)
+typedef struct batch_s batch_t;
+typedef struct worker_s worker_t;
+typedef struct bitem_s bitem_t;
+
+struct bitem_s {
+  const char * stem;			/* output name without extension */
+  int len, idx;
+};
+
+struct worker_s {
+  pthread_t tid;
+  pthread_mutex_t lock;			/* protects lo and hi */
+  int lo, hi;				/* items left: [lo,hi) */
+  int cpu;				/* -1: not pinned */
+  int started;
+  batch_t * batch;
+};
+
+struct batch_s {
+  const pngtopi1_ctx * ctx;		/* copied by each worker */
+  char ** paths;
+  int * res;
+  bitem_t * items;			/* sorted by stem */
+  int * group;				/* work item g is items
+					 * [group[g],group[g+1]) */
+  worker_t * workers;
+  int nworkers;
+};
+
+static void bitem_set(bitem_t * it, char * path, int idx, int dir)
 {
-  PXL_CHECK(1,PNG_COLOR_TYPE_GRAY,1);
-  return rgb_8to4[(uint8_t)-(1 & ( png->rows[y][x>>3] >> (~x&7) ))];
+  const char * base = strrchr(path, '/'), * dot;
+
+  base = base ? base+1 : path;
+  dot = strrchr(base, '.');
+  if (!dot || dot == base)
+    dot = base + strlen(base);
+  it->stem = dir ? path : base;
+  it->len = dot - it->stem;
+  it->idx = idx;
 }
 
-static uint16_t get_gray2(const mypng_t * png, int x, int y)
+static int bitem_cmp(const void * _a, const void * _b)
 {
-  int g2;
-  PXL_CHECK(2,PNG_COLOR_TYPE_GRAY,1);
-  g2 = 3 & ( ( png->rows[y][x>>2] ) >> ((~x&3)<<1) );
-  g2 |= (g2<<2);
-  g2 |= (g2<<4);
-  return rgb444(g2,g2,g2);
+  const bitem_t * const a = _a, * const b = _b;
+  int c = memcmp(a->stem, b->stem, a->len < b->len ? a->len : b->len);
+  if (!c) c = a->len - b->len;
+  if (!c) c = a->idx - b->idx;
+  return c;
 }
 
-static uint16_t get_gray4(const mypng_t * png, int x, int y)
+/* Same automatic output name. */
+static int bitem_same(const bitem_t * a, const bitem_t * b)
 {
-  int g4;
-  PXL_CHECK(4,PNG_COLOR_TYPE_GRAY,1);
-  g4 = 15 & ( png->rows[y][x>>1] >> (((~x&1)) << 2));
-  g4 |= g4 << 4;
-  return rgb444(g4,g4,g4);
+  return a->len == b->len && !memcmp(a->stem, b->stem, a->len);
 }
 
-static uint16_t get_gray8(const mypng_t * png, int x, int y)
+static int worker_left(worker_t * w)
 {
-  PXL_CHECK(8,PNG_COLOR_TYPE_GRAY,1);
-  return rgb_8to4[(uint8_t)png->rows[y][x]];
+  int left;
+  pthread_mutex_lock(&w->lock);
+  left = w->hi - w->lo;
+  pthread_mutex_unlock(&w->lock);
+  return left;
 }
 
-
-/* ----------------------------------------------------------------------
- *  Indexed methods
- **/
-
-static uint16_t get_indexed2(const mypng_t * png, int x, int y)
+/* Next item for w, -1 when the whole batch is taken. */
+static int worker_next(worker_t * w)
 {
-  png_color * rgb; int idx;
+  batch_t * const b = w->batch;
+  int i = -1, lo = 0, hi = 0;
+
+  pthread_mutex_lock(&w->lock);
+  if (w->lo < w->hi)
+    i = w->lo++;
+  pthread_mutex_unlock(&w->lock);
+
+  while (i < 0) {
+    worker_t * v = 0;
+    int most = 0, k, left;
+
+    for (k=0; k<b->nworkers; ++k)
+      if (b->workers+k != w && (left = worker_left(b->workers+k)) > most)
+	most = left, v = b->workers+k;
+    if (!v)
+      break;
 
-  PXL_CHECK(2,PNG_COLOR_TYPE_PALETTE,1);
-  idx = 3 & ( ( png->rows[y][x>>2] ) >> ((~x&3)<<1) );
-  LUT_CHECK(idx);
-  rgb = &png->lut[idx];
-  return rgb444(rgb->red,rgb->green,rgb->blue);
+    pthread_mutex_lock(&v->lock);
+    if (v->lo < v->hi) {
+      lo = v->lo + (v->hi - v->lo) / 2;
+      hi = v->hi;
+      v->hi = lo;
+    }
+    pthread_mutex_unlock(&v->lock);
+    if (lo < hi) {
+      i = lo;
+      pthread_mutex_lock(&w->lock);
+      w->lo = lo+1;
+      w->hi = hi;
+      pthread_mutex_unlock(&w->lock);
+    }
+  }
+  return i;
 }
 
-static uint16_t get_indexed4(const mypng_t * png, int x, int y)
+static void * worker_run(void * arg)
 {
-  png_color * rgb; int idx;
-
-  PXL_CHECK(4,PNG_COLOR_TYPE_PALETTE,1);
-  idx = 15 & ( png->rows[y][x>>1] >> ((~x&1) << 2) );
-  LUT_CHECK(idx);
-  rgb = &png->lut[idx];
-  return rgb444(rgb->red,rgb->green,rgb->blue);
+  worker_t * const w = arg;
+  batch_t * const b = w->batch;
+  pngtopi1_ctx ctx = *b->ctx;
+  int g, k;
+
+  if (w->cpu >= 0) {
+#ifdef CPU_SET
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(w->cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+      wmsg("could not pin worker to CPU #%d\n", w->cpu);
+#endif
+  }
+  while (g = worker_next(w), g >= 0)
+    for (k=b->group[g]; k<b->group[g+1]; ++k) {
+      const int i = b->items[k].idx;
+      b->res[i] = convert_file(&ctx, b->paths[i], 0);
+    }
+  return 0;
 }
 
-static uint16_t get_indexed8(const mypng_t * png, int x, int y)
+/* Convert n paths with jobs workers (0: one per CPU). */
+static int convert_pool(const pngtopi1_ctx * ctx,
+			char ** paths, int * res, int n, int jobs)
 {
-  png_color * rgb;
+  int ncpu = 1, ngroups = 0, i, ret = -1;
+  batch_t b;
 
-  PXL_CHECK(8,PNG_COLOR_TYPE_PALETTE,1);
-  LUT_CHECK(png->rows[y][x]);
-  rgb = &png->lut[png->rows[y][x]];
-  return rgb444(rgb->red,rgb->green,rgb->blue);
-}
-
-/* ----------------------------------------------------------------------
- *  Direct colors
- **/
-
-static uint16_t get_rgb(const mypng_t * png, int x, int y)
-{
-  PXL_CHECK(8,PNG_COLOR_TYPE_RGB,3);
-
-  const png_byte r = png->rows[y][x*3+0];
-  const png_byte g = png->rows[y][x*3+1];
-  const png_byte b = png->rows[y][x*3+2];
-
-  return rgb444(r,g,b);
-}
-
-static uint16_t get_rgba(const mypng_t * png, int x, int y)
-{
-  PXL_CHECK(8,PNG_COLOR_TYPE_RGBA,4);
-
-  const png_byte r = png->rows[y][x*4+0];
-  const png_byte g = png->rows[y][x*4+1];
-  const png_byte b = png->rows[y][x*4+2];
+#ifdef _SC_NPROCESSORS_ONLN
+  ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  if (ncpu < 1) ncpu = 1;
+#endif
+#ifndef CPU_SET
+  if (opt_aff)
+    wmsg("CPU affinity is not supported on this platform\n");
+#endif
 
-  return rgb444(r,g,b);
+  memset(&b, 0, sizeof(b));
+  b.ctx = ctx;
+  b.paths = paths;
+  b.res = res;
+  if (b.items = mf_malloc(n * sizeof(*b.items)), !b.items)
+    goto exit;
+  if (b.group = mf_malloc((n+1) * sizeof(*b.group)), !b.group)
+    goto exit;
+  for (i=0; i<n; ++i)
+    bitem_set(b.items+i, paths[i], i, opt_dir);
+  qsort(b.items, n, sizeof(*b.items), bitem_cmp);
+  for (i=0; i<n; ++i)
+    if (!i || !bitem_same(b.items+i, b.items+i-1))
+      b.group[ngroups++] = i;
+  b.group[ngroups] = n;
+
+  if (!jobs) jobs = ncpu;
+  if (jobs > ngroups) jobs = ngroups;
+  b.nworkers = jobs;
+  if (b.workers = mf_calloc(jobs * sizeof(worker_t)), !b.workers)
+    goto exit;
+  for (i=0; i<jobs; ++i) {
+    worker_t * const w = b.workers+i;
+    pthread_mutex_init(&w->lock, 0);
+    w->lo = (int64_t) ngroups * i / jobs;
+    w->hi = (int64_t) ngroups * (i+1) / jobs;
+    w->cpu = opt_aff ? i % ncpu : -1;
+    w->batch = &b;
+  }
+  amsg("batch: %d file(s), %d worker(s)\n", n, jobs);
+
+  /* This thread is worker #0. A worker that fails to start leaves
+   * its range to the others. */
+  for (i=1; i<jobs; ++i)
+    b.workers[i].started =
+      !pthread_create(&b.workers[i].tid, 0, worker_run, b.workers+i);
+  worker_run(b.workers);
+  for (i=1; i<jobs; ++i)
+    if (b.workers[i].started)
+      pthread_join(b.workers[i].tid, 0);
+
+  for (i=0; i<jobs; ++i)
+    pthread_mutex_destroy(&b.workers[i].lock);
+  ret = 0;
+exit:
+  free(b.workers);
+  free(b.group);
+  free(b.items);
+  return ret;
 }
 
 /* ----------------------------------------------------------------------
- |
- | Image functions.
- |
- * ---------------------------------------------------------------------- */
-
-static void myimg_free(myimg_t ** img)
-{
-  assert( img );
-  if (*img) {
-    free(*img);
-    *img = 0;
-  }
-}
+ * Batch pipeline (--in-flight)
+ *
+ * A reader thread loads the inputs in memory, the workers convert
+ * them to memory outputs and this thread writes the outputs in input
+ * order. File I/O overlaps with the conversions. At most "in-flight"
+ * images are read and not yet written: the jobs are a ring of that
+ * size and a stage waits for the next one when it is ahead. An input
+ * with the same stem as an earlier one may be that item's output: it
+ * is not read before the earlier item is written.
+ **/
 
-static myimg_t * mypng_init(char * path)
-{
-  myimg_t * img = mf_calloc(sizeof(img->png));
-  if (img) {
-    strcpy((char*)img->png.magic, "PNG");
-    img->png.path = path ? path : "<mypng>";
-    img->png.type = PNG;
-  }
-  return img;
-}
+enum { JOB_FREE, JOB_LOADED, JOB_DONE };
+
+typedef struct pipe_s pipe_t;
+struct pipe_s {
+  const pngtopi1_ctx * ctx;		/* copied by each worker */
+  char ** paths;
+  int * res;
+  int n, cap;
+  int * after;				/* read i once after[i] written */
+  mfjob_t * jobs;			/* ring of cap jobs */
+  int loaded, taken, written;		/* stage positions */
+  pthread_mutex_t lock;			/* protects all of the above */
+  pthread_cond_t cond;			/* any change */
+};
 
-static myimg_t * read_img_file(char * ipath)
+/* Load a whole input. Failures are left to the conversion that will
+ * open the file again and report them. */
+static void pipe_load(mfjob_t * job)
 {
-  png_byte header[8];
-  myimg_t * img = 0;
-  int y;
-  myfile_t mf;
-
-  if (-1 == mf_open(&mf, ipath, 1))
-    goto error;
-
-  if (-1 == (int)mf_read(&mf, header, 8))
-    goto error;
-
-  if (png_sig_cmp(header, 0, 8)) {
-
-    /* -------------------
-     * Trying Degas format
-     **/
-    if (img = mypix_from_file(&mf), !img)
-      goto exit;
-  }
-
-  else {
-    /* ---------------
-     * Trying with PNG
-     */
-
-    mypng_t * png;
-
-    img = mypng_init(ipath);
-    if (!img)
-      goto error;
-    png = & img->png;
-
-    png->png = png_create_read_struct(PNG_LIBPNG_VER_STRING,0,0,0);
-    if (!png->png)
-      goto png_error;
-
-    png->inf = png_create_info_struct(png->png);
-    if (!png->inf)
-      goto png_error;
-
-    if (setjmp(png_jmpbuf(png->png)))
-      goto png_error;
-
-    png_init_io(png->png,mf.file);
-    png_set_sig_bytes(png->png,8);
-    png_read_info(png->png, png->inf);
-
-    png->w = png_get_image_width(png->png, png->inf);
-    png->h = png_get_image_height(png->png, png->inf);
-    png->d = png_get_bit_depth(png->png, png->inf);
-    png->t = png_get_color_type(png->png, png->inf);
-    png->i = png_get_interlace_type(png->png, png->inf);
-    png->z = png_get_compression_type(png->png, png->inf);
-    png->f = png_get_filter_type(png->png,png->inf);
-    png->c = png_get_channels(png->png, png->inf);
-    png->p = png_set_interlace_handling(png->png);
-    png_read_update_info(png->png, png->inf);
-
-    /* read file */
-    if (setjmp(png_jmpbuf(png->png)))
-      goto png_error;
-
-    png_get_PLTE(png->png, png->inf, &png->lut, &png->lutsz);
-    if (png->lutsz) {
-      const png_byte m = (opt_col&3) == CQ_STE ? 0x0F0 : 0x1F;
-      int i;
-
-      amsg("PNG color look-up table has %d entries:\n", png->lutsz);
-      for (i=0; i<png->lutsz; ++i)
-	amsg(
-	  "%3d #%02X%02X%02X $%03x #%02X%02X%02X\n",
-	  i,png->lut[i].red,png->lut[i].green,png->lut[i].blue,
-	  rgb444(png->lut[i].red,png->lut[i].green,png->lut[i].blue),
-	  png->lut[i].red&m, png->lut[i].green&m, png->lut[i].blue&m);
+  FILE * f = fopen(job->ipath, "rb");
+  long len;
+
+  if (!f)
+    return;
+  if (!fseek(f, 0, SEEK_END) && (len = ftell(f)) > 0 && len <= (1<<24)
+      && !fseek(f, 0, SEEK_SET) && (job->data = malloc(len), job->data)) {
+    if (fread(job->data, 1, len, f) == (size_t) len)
+      job->len = len;
+    else {
+      free(job->data);
+      job->data = 0;
     }
-
-    png->rows = (png_bytep *)
-      png_malloc(png->png, png->h*(sizeof (png_bytep)));
-
-    for (y=0; y<png->h; ++y)
-      png->rows[y] = (png_byte *)
-	png_malloc(png->png, png_get_rowbytes(png->png,png->inf));
-
-    png_read_image(png->png, png->rows);
   }
-
-exit:
-  mf_close(&mf);
-  return img;
-
-png_error:
-  pngerror(ipath);
-error:
-  myimg_free(&img);
-  goto exit;
-}
-
-static const char * mypng_typestr(int type)
-{
-# define CASE_COLOR_TYPE(A) case PNG_COLOR_TYPE_##A: return #A
-# define CASE_COLOR_MASK(A) case PNG_COLOR_MASK_##A: return #A
-  static char s[8];
-  switch (type) {
-    CASE_COLOR_TYPE(GRAY);	     /* (bit depths 1, 2, 4, 8, 16) */
-    CASE_COLOR_TYPE(GRAY_ALPHA);     /* (bit depths 8, 16) */
-    CASE_COLOR_TYPE(PALETTE);	     /* (bit depths 1, 2, 4, 8) */
-    CASE_COLOR_TYPE(RGB);	     /* (bit_depths 8, 16) */
-    CASE_COLOR_TYPE(RGB_ALPHA);	     /* (bit_depths 8, 16) */
-    /* CASE_COLOR_MASK(PALETTE); */
-    /* CASE_COLOR_MASK(COLOR); */
-    /* CASE_COLOR_MASK(ALPHA); */
-  }
-  sprintf(s,"?%02x?", type & 255);
-  return s;
-}
-
-static int cc_cmp(const void * _a, const void * _b)
-{
-  const colcnt_t * const a = _a;
-  const colcnt_t * const b = _b;
-  return b->cnt - a->cnt;
-}
-
-static int lumi(int x)
-{
-  int r,g,b;
-  assert( (x & 0xfff) == x );
-  r = ste_to_std[x>>8];
-  g = ste_to_std[(x>>4)&15];
-  b = ste_to_std[x&15];
-  return r*2 + g*4 + b;
-}
-
-static int cl_cmp(const void * _a, const void * _b)
-{
-  const colcnt_t * const a = _a;
-  const colcnt_t * const b = _b;
-  return lumi(a->rgb) - lumi(b->rgb);
+  fclose(f);
 }
 
-void sort_colorcount(colcnt_t * cc, int n)
+static void * pipe_reader(void * arg)
 {
-  qsort(cc, n, sizeof(colcnt_t), cc_cmp);
-}
-
-void sort_colorbright(colcnt_t * cc, int n)
-{
-  qsort(cc, n, sizeof(colcnt_t), cl_cmp);
-}
+  pipe_t * const pp = arg;
+  int i;
 
-static myimg_t * mypix_alloc(int id, char * path)
-{
-  myimg_t * img;
-
-  assert( (uint_t) id < 6u );
-
-  img = mf_malloc(sizeof(mypix_t));
-  if (img) {
-    strcpy((char*)img->pix.magic, degas[id].name);
-    img->pix.w = degas[id].w;
-    img->pix.h = degas[id].h;
-    img->pix.d = degas[id].d;
-    img->pix.c = degas[id].c;
-    img->pix.path = path ? path :"<mypix>";
-    img->pix.type = degas[id].rle ? PCX : PIX;
-  }
-  return img;
-}
+  for (i=0; i<pp->n; ++i) {
+    mfjob_t * const job = pp->jobs + i % pp->cap;
 
+    pthread_mutex_lock(&pp->lock);
+    while (i - pp->written >= pp->cap || pp->after[i] >= pp->written)
+      pthread_cond_wait(&pp->cond, &pp->lock);
+    pthread_mutex_unlock(&pp->lock);
 
-static int rle_read(myfile_t * mf, myimg_t * img)
-{
-  const int tiles_per_line = img->pix.w >> 4;
-  const int bytes_per_plan = tiles_per_line << 1;
-  const int bytes_per_line = bytes_per_plan << img->pix.d;
-  const int bytes_per_tile = 2 << img->pix.d;
-  uint8_t * dst = img->pix.bits + 34, raw[80];
-  int y,x,z;
-
-  assert( bytes_per_plan <= 80 );
-
-  /* For each line */
-  for ( y=0; y < img->pix.h; ++y, dst += bytes_per_line ) {
-
-    /* For each plan */
-    for ( z=0; z < 1<<img->pix.d; ++z ) {
-      uint8_t * row = dst + (z<<1);
-
-      /* decode an entire bitplan line */
-      for (x=0; x<bytes_per_plan; ) {
-	uint8_t rle[2];
-
-	/* read code + 1 */
-	if ( -1 == mf_read(mf, rle, 2 ) )
-	  return -1;
-
-	if (*rle >= 128) {
-	  /* Fill 257-rle[0] with rle[1] */
-	  const uint8_t v = rle[1];
-	  int n = 257 - *rle;
-
-	  if (x+n > bytes_per_plan) {
-	    emsg("rle-fill overflow line:%d plan:%d byte:%d\n",y,z,x);
-	    return -1;
-	  }
-	  do {
-	    raw[x++] = v;
-	  } while (--n);
-
-	} else {
-	  /* Copy rle[1] and rle[0] more bytes */
-	  const int n = *rle + 1;
-	  if (x+n > bytes_per_plan) {
-	    emsg("rle-copy overflow line:%d plan:%d byte:%d\n",y,z,x);
-	    return -1;
-	  }
-	  if ( -1 == mf_read(mf, raw+x+1, n-1) )
-	    return -1;
-	  raw[x] = rle[1];
-	  x += n;
-	}
-      }
-      assert( x == bytes_per_plan );
+    memset(job, 0, sizeof(*job));
+    job->ipath = pp->paths[i];
+    pipe_load(job);
 
-      /* For each tile (interlacing) */
-      for (x=0; x<bytes_per_plan; x += 2) {
-	row[0] = raw[x+0];
-	row[1] = raw[x+1];
-	row += bytes_per_tile;
-      }
-    }
+    pthread_mutex_lock(&pp->lock);
+    job->state = JOB_LOADED;
+    pp->loaded = i+1;
+    pthread_cond_broadcast(&pp->cond);
+    pthread_mutex_unlock(&pp->lock);
   }
   return 0;
 }
 
-
-static myimg_t * mypix_from_file(myfile_t * const mf)
+static void * pipe_worker(void * arg)
 {
-  uint8_t hd[34];
-  int id, i;
-  myimg_t * img = 0;
-
-  assert( mf->file );
-  assert( mf->path );
-  assert( mf->mode == 1 );
-
-  if (-1 == mf_seek(mf,0,SEEK_SET))
-    goto error;
-  if (-1 == mf_read(mf,hd,34))
-    goto error;
-
-  id = (hd[0]<<8) | hd[1];
-  for (i=0; i<6; ++i) {
-    if (id == degas[i].id) {
-      if (mf->len < degas[i].minsz) {
-	emsg("file length (%u) is too short for %s image -- %s\n",
-	     (uint_t) mf->len, degas[i].name, mf->path);
-	return 0;
-      }
-      break;
-    }
-  }
-  if (i == 6) {
-    notpng(mf->path);
-    return 0;
-  }
-  dmsg("%s detected\n", degas[i].name);
+  pipe_t * const pp = arg;
+  pngtopi1_ctx ctx = *pp->ctx;
 
-  img = mypix_alloc(i,mf->path);
-  if (!img)
-    return 0;
+  for (;;) {
+    mfjob_t * job;
+    int i;
+
+    pthread_mutex_lock(&pp->lock);
+    while (pp->taken < pp->n && pp->taken >= pp->loaded)
+      pthread_cond_wait(&pp->cond, &pp->lock);
+    i = pp->taken < pp->n ? pp->taken++ : -1;
+    pthread_mutex_unlock(&pp->lock);
+    if (i < 0)
+      break;
 
-  memcpy(img->pix.bits,hd,34);		/* copy header */
-  if ( ! degas[i].rle ) {
-    /* Uncompressed Degas image */
-    if ( -1 == mf_read(mf, img->pix.bits+34, 32000) )
-      goto error;
-  } else {
-    /* uncompress on the fly */
-    if ( -1 == rle_read(mf, img))
-      goto error;
+    job = pp->jobs + i % pp->cap;
+    if (!job->data)
+      /* Not loaded: convert_file() reports why (nothing to write) */
+      pp->res[i] = convert_file(&ctx, job->ipath, 0);
+    else
+      pp->res[i] = convert_data(&ctx, job->ipath, 0,
+				job->data, job->len, &job->out);
+
+    pthread_mutex_lock(&pp->lock);
+    job->state = JOB_DONE;
+    pthread_cond_broadcast(&pp->cond);
+    pthread_mutex_unlock(&pp->lock);
   }
-
-  return img;
-
-error:
-  myimg_free(&img);
   return 0;
 }
 
-
-static myimg_t * mypix_from_png(mypng_t * png)
+/* Save the output of a job and free it. */
+static int pipe_write(mfjob_t * job)
 {
-  static struct {
-    int d,c,t;				/* depth,channel,type */
-    get_f get;				/* get pixel function */
-  } *s, supported[] = {
-    /* 320 x 200 */
-    { 1, 1, PNG_COLOR_TYPE_GRAY,    get_gray1	 },
-    { 2, 1, PNG_COLOR_TYPE_GRAY,    get_gray2	 },
-    { 4, 1, PNG_COLOR_TYPE_GRAY,    get_gray4	 },
-    { 8, 1, PNG_COLOR_TYPE_GRAY,    get_gray8	 },
-    { 2, 1, PNG_COLOR_TYPE_PALETTE, get_indexed2 },
-    { 4, 1, PNG_COLOR_TYPE_PALETTE, get_indexed4 },
-    { 8, 1, PNG_COLOR_TYPE_PALETTE, get_indexed8 },
-    { 8, 3, PNG_COLOR_TYPE_RGB,	    get_rgb	 },
-    { 8, 4, PNG_COLOR_TYPE_RGBA,    get_rgba	 },
-    /**/
-    { 0,0,0,0 }
-  };
-
-  myimg_t * img = 0;
-  uint8_t * bits;
-  int x, y, z, log2plans, lutsiz, lutmax, ncolors;
-
-  uint16_t lut[16];
-  colcnt_t * const colcnt = g_colcnt;
-
-  int id;
-
-  for (id=0; id<6; id += 2)
-    if (png->w == degas[id].w && png->h == degas[id].h)
-      break;
+  const int ecode = save_output(job->ipath, 0, &job->out);
 
-  if (id == 6) {
-    emsg("incompatible image dimension <%dx%d> -- %s\n",
-	 png->w,png->h,png->path);
-    return 0;
-  }
-
-  log2plans = degas[id].d;
-  lutmax    = 1<<(1<<log2plans);
-  assert( lutmax <= 16 );
-
-  dmsg("search for d:%2d c:%2d %s(%d)\n",
-       png->d,png->c,mypng_typestr(png->t),png->t);
-  for (s=supported; s->d; ++s) {
-    dmsg("    versus d:%2d c:%2d %s(%d)\n",
-	 s->d,s->c,mypng_typestr(s->t),s->t);
-    if (s->d == png->d && s->c == png->c && s->t == png->t)
-      break;
-  }
-
-  if (!s->d) {
-    emsg("incompatible image format -- %s\n",png->path);
-    return 0;
-  }
-
-  /* count color occurrences */
-  for ( x=0; x < 0x1000; ++x ) {
-    colcnt[x].rgb = x;
-    colcnt[x].cnt = 0;
-  }
-  for ( y=0; y < png->h; ++y )
-    for ( x=0; x < png->w; ++x )
-      ++ colcnt[ s->get(png,x,y) ].cnt;
-
-#ifdef DEBUG
-  ncolors = 0;
-  for (y=0; y<0x1000; ++y) {
-    if (colcnt[y].cnt) {
-      assert( y == colcnt[y].rgb );
-      dmsg(" #%02d $%03X is used %5d times\n",
-	   ncolors, y, colcnt[y].cnt);
-      ncolors++;
-    }
-  }
-#endif
-
-  sort_colorcount(colcnt, 0x1000);
-
-  for ( x=0; x<0x1000 && colcnt[x].cnt; ++x )
-    dmsg(" #%02d $%03X %+6d\n", x, colcnt[x].rgb, colcnt[x].cnt);
-
-  if (x > lutmax) {
-    emsg("too many colors -- %d > %d -- %s", x, lutmax,png->path);
-    return 0;
-  }
-
-  if (x < lutmax)
-    amsg("using only %d colors out of %d\n", x, lutmax);
-
-  /* Supporting by brightness is only necessary for P?3 images */
-  sort_colorbright(colcnt, x);
-
-#ifdef DEBUG
-  dmsg("Sorted by lumi\n");
-  for (y=0; y < x; ++y) {
-    dmsg(" #%02d $%03X %+6d\n", y, colcnt[y].rgb, colcnt[y].cnt);
-  }
-#endif
-
-  lut[0] = 0;
-  for (y=0; y < x; ++y)
-    lut[y] = colcnt[y].rgb;
-  ncolors = y;
-  for (lutsiz = degas[id].c ; y < 16; ++y)
-    lut[y] = 0x0F0;
-  y = ncolors;
-
-  assert( (( (((15+png->w)>>4)<<1) << log2plans) * png->h) == 32000 );
-
-  if (img = mypix_alloc(id, png->path), !img)
-    return 0;
-
-  bits = img->pix.bits;
-
-  /* Degas signature */
-  *bits++ = degas[id].id >> 8;
-  *bits++ = degas[id].id;
-
-  /* Copy palette */
-  for (y=0; y<lutsiz; ++y) {
-    const uint_t col = lut[ y ];
-
-    if ( (col & 0xFFF) != col ) {
-      dmsg( "#%d/%d %x\n",y,lutsiz, col);
-    }
-
-    assert( (col & 0xFFF) == col );
-    *bits++ = col >> 8;
-    *bits++ = col;
-  }
-  if (!y)
-    *bits++ = 0xF, *bits++ = 0xFF, ++y;
-  for (; y<16; ++y) {
-    *bits++ = 0;
-    *bits++ = 0;
-  }
-
-  assert( bits == (img->pix.bits + 34) );
-
-  /* Blit pixels */
-
-  /* Use color occurence array as reverse table */
-  dmsg("Reverse LUT\n");
-  for (y=0; y < ncolors; ++y) {
-    int rgb = lut[y];
-    assert( (rgb & 0xFFF) == rgb );
-    colcnt[rgb].rgb = y;
-  }
-
-  /* Per row */
-  for (y=0; y < img->pix.h; ++y) {
-    /* Per 16-pixels block */
-    for (x=0; x < img->pix.w; x+=16) {
-      /* Per bit-plan */
-      for (z=0; z<(1<<img->pix.d); ++z) {
-	uint_fast16_t bm, bv;
-	/* Per pixel in block */
-	for (bv=0, bm=0x8000; bm; ++x, bm >>= 1) {
-	  const unsigned rgb = s->get(png,x,y);
-	  assert(rgb < 0x1000);
-	  const unsigned idx = colcnt[rgb].rgb;
-	  assert(idx < ncolors);
-	  if (idx & (1<<z))
-	    bv |= bm;
-	}
-	x -= 16;
-	*bits++ = bv>>8;
-	*bits++ = bv;
-      }
-    }
-  }
-  assert( bits == img->pix.bits+32034 );
-
-  return img;
+  pngtopi1_free(job->out.data);
+  job->out.data = 0;
+  free(job->data);
+  job->data = 0;
+  return ecode;
 }
 
-static void
-print_buffer(const uint8_t * b, int n, const char * label)
+/* Convert n paths with jobs workers (0: one per CPU) and at most cap
+ * images in memory. */
+static int convert_pipe(const pngtopi1_ctx * ctx,
+			char ** paths, int * res, int n, int jobs, int cap)
 {
-#ifdef DEBUG
-  int i, l = strlen(label);
+  pthread_t reader, * tid = 0;
+  int i, nworkers = 0, ret = -1;
+  bitem_t * items = 0;
+  pipe_t pp;
 
-  for (i=0; i<n; ++i) {
-    if (!i)
-      dmsg("\n%s:",label);
-    else if( ! (i & 15) )
-      dmsg("\n%*s",l+1,"");
-    dmsg(" %02x",b[i]);
-  }
-  dmsg("\n");
-#else
-# ifndef UNUSED
-#  define UNUSED(X) (void) X
-# endif
-  UNUSED(b);
-  UNUSED(n);
-  UNUSED(label);
+#ifdef _SC_NPROCESSORS_ONLN
+  if (!jobs) jobs = sysconf(_SC_NPROCESSORS_ONLN);
 #endif
-}
-
-/*
- * RLE coding: code: 00..7f copy code+1 byte [1..128]
- *                   80..ff fill next byte 257-code times [2..129]
- */
+  if (jobs < 1) jobs = 1;
+  if (cap > n) cap = n;
+
+  memset(&pp, 0, sizeof(pp));
+  pp.ctx = ctx;
+  pp.paths = paths;
+  pp.res = res;
+  pp.n = n;
+  pp.cap = cap;
+  pthread_mutex_init(&pp.lock, 0);
+  pthread_cond_init(&pp.cond, 0);
+  if (pp.jobs = mf_calloc(cap * sizeof(*pp.jobs)), !pp.jobs)
+    goto exit;
+  if (tid = mf_malloc(jobs * sizeof(*tid)), !tid)
+    goto exit;
 
-static int
-enc_copy(uint8_t * d, const uint8_t * s, int l)
-{
-  const uint8_t * const d0 = d;
-  while (l > 0) {
-    int n = l;
-    if (n > 128) n = 128;
-    l -= n;
-    if (d0) {
-      assert( n >= 1 && n <= 128 );
-      d[0] = n-1;
-      memcpy(d+1,s,n);
-      print_buffer(d, n+1, "CPY");
-    }
-    d += 1+n;
-    s += n;
+  /* Same grouping as convert_pool(): after[i] is the previous item
+   * of the group of i, -1 for the first one. */
+  if (items = mf_malloc(n * sizeof(*items)), !items)
+    goto exit;
+  if (pp.after = mf_malloc(n * sizeof(*pp.after)), !pp.after)
+    goto exit;
+  for (i=0; i<n; ++i)
+    bitem_set(items+i, paths[i], i, opt_dir);
+  qsort(items, n, sizeof(*items), bitem_cmp);
+  for (i=0; i<n; ++i)
+    pp.after[items[i].idx] =
+      i && bitem_same(items+i, items+i-1) ? items[i-1].idx : -1;
+
+  /* This thread is the writer: it can not stand in for a worker. */
+  for (i=0; i<jobs; ++i, ++nworkers)
+    if (pthread_create(tid+i, 0, pipe_worker, &pp))
+      break;
+  if (nworkers && pthread_create(&reader, 0, pipe_reader, &pp)) {
+    pthread_mutex_lock(&pp.lock);
+    pp.n = 0;				/* stop the workers */
+    pthread_cond_broadcast(&pp.cond);
+    pthread_mutex_unlock(&pp.lock);
+    for (i=0; i<nworkers; ++i)
+      pthread_join(tid[i], 0);
+    nworkers = 0;
   }
-  return d-d0;
-}
-
-static int
-enc_fill(uint8_t * d, const uint8_t v, int l)
-{
-  const uint8_t * const d0 = d;
-  while (l >= 2) {
-    int n = l;
-    if (n > 129)
-      /* GB: Ensure at least 2 bytes remaining for the last pass. */
-      n = 129 - (n==130);
-    l -= n;
-    if (d0) {
-      assert( n >= 2 && n <= 129 );
-      d[0] = 257 - n;
-      d[1] = v;
-      print_buffer(d, 2, "RPT");
-    }
-    d += 2;
+  if (!nworkers) {
+    syserror(0, "thread error");
+    goto exit;
   }
-  assert(l == 0);
-  return d-d0;
-}
-
-static int
-pcx_encode_row(uint8_t * dst, const uint8_t * src, int len)
-{
-  int i, j, o;
-
-  assert(src);
-  assert(len > 0);
+  amsg("batch: %d file(s), %d worker(s), %d in flight\n",
+       n, nworkers, cap);
 
-  print_buffer(src,len,"RAW");
-
-  for (i=j=o=0; i<len; ) {
-    const uint8_t c = src[i];
-    int k,l;
-
-    /* Count repeat */
-    for (k=i+1; k<len && src[k] == c; ++k)
-      ;
-    l = k-i;				/* number of repeat 1..N */
-
-    if (l >= 2) {			/* have some repeat ? */
-      if (i > o) {			/* have something to copy first ? */
-	j += enc_copy(dst+j, src+o, i-o);
-	o = i;
-      }
-      j += enc_fill(dst+j, c, l);
-      o = i = k;
-    }
-    i = k;
+  for (i=0; i<n; ++i) {
+    mfjob_t * const job = pp.jobs + i % cap;
+    int err;
+
+    pthread_mutex_lock(&pp.lock);
+    while (i >= pp.loaded || job->state != JOB_DONE)
+      pthread_cond_wait(&pp.cond, &pp.lock);
+    pthread_mutex_unlock(&pp.lock);
+
+    if (err = pipe_write(job), err && !res[i])
+      res[i] = err;
+
+    pthread_mutex_lock(&pp.lock);
+    job->state = JOB_FREE;
+    pp.written = i+1;
+    pthread_cond_broadcast(&pp.cond);
+    pthread_mutex_unlock(&pp.lock);
   }
-  j += enc_copy(dst+j, src+o, i-o);
 
-  print_buffer(dst, j, "ENC");
+  pthread_join(reader, 0);
+  for (i=0; i<nworkers; ++i)
+    pthread_join(tid[i], 0);
+  ret = 0;
 
-  return j;
+exit:
+  pthread_cond_destroy(&pp.cond);
+  pthread_mutex_destroy(&pp.lock);
+  free(tid);
+  free(pp.jobs);
+  free(pp.after);
+  free(items);
+  return ret;
 }
 
-#ifdef DEBUG
-
-static int
-rle_decode(uint8_t * d, int dl, const uint8_t * s, int sl)
+/* Read the next NUL separated entry of f in *pbuf (grown as needed).
+ * Returns its length, -1 at end of file and -2 on alloc error. */
+static int list_read(FILE * f, char ** pbuf, size_t * pmax)
 {
-  int i,j;
-
-  for (i=j=0; i<sl && j<dl; ) {
-    int c = s[i++];
-    if (c < 128) {
-      /* Copy c+1 byte */
-      if (j+c+1 > dl) {
-	return -1;
-      }
-      for (++c; c; --c)
-	d[j++] = s[i++];
-    } else {
-      /* Fill 257-c times next byte */
-      const uint8_t v = s[i++];
-      if (j+257-c > dl) {
-	return -1;
-      }
-      for (c=257-c; --c >= 0;)
-	d[j++] = v;
-    }
-  }
-  print_buffer(d,j,"DEC");
-  assert( i <= sl );
-  assert( j <= dl );
-  return j;
-}
-
-#endif
+  size_t len = 0;
 
-static int save_as_pcx(myfile_t * out, mypix_t * pic)
-{
-  const int bpr = (pic->w>>4) << (pic->d+1); /* bytes per row */
-  const int off = 2 << pic->d;	     /* offset to next word in plan */
-  int x,y,z;
-
-  uint8_t rle[128], raw[80], *r;
-  const uint8_t * pix = pic->bits+34;
-
-  /* Write header */
-  pic->type = PCX;
-  pic->magic[1] = 'C';
-  pic->bits[0] = DEGAS_PC1 >> 8;
-  if (-1 == mf_write(out, pic->bits, 34))
-    return -1;
+  for (;;) {
+    const int c = fgetc(f);
 
-  /* De-interleave into raw[] and RLE encode into rle[] */
-
-  /* For each line */
-  for (y=0; y<pic->h; ++y, pix += bpr) {
-    /* For each plan */
-    for (z=0; z<(1<<pic->d); ++z) {
-      int l;
-      const uint8_t * row = pix + (z<<1);
-      /* For each 16-pixels tile */
-      for (x=0, r=raw; x<pic->w>>4; ++x) {
-	*r++ = row[0];
-	*r++ = row[1];
-	row += off;
-      }
-      l = pcx_encode_row(rle, raw, r-raw);
-
-#ifdef DEBUG
-      if (1) {
-	uint8_t xxx[80];
-	int lx = rle_decode(xxx, 80, rle, l);
-	assert(lx == bpr >> pic->d) ;
-	assert(!memcmp(raw,xxx,lx));
+    if (c == EOF && !len)
+      return -1;
+    if (len == *pmax) {
+      const size_t max = *pmax ? *pmax * 2 : 256;
+      char * const tmp = realloc(*pbuf, max);
+      if (!tmp) {
+	syserror(0, "alloc error");
+	return -2;
       }
-#endif
-      if (-1 == mf_write(out, rle,l))
-	return -1;
+      *pbuf = tmp;
+      *pmax = max;
     }
-  }
-  return (int) out->len;
-}
-
-static int save_as_pix(myfile_t * out, mypix_t * pic)
-{
-  const int l = pic->h * ( (pic->w>>4) << (pic->d+1) );
-
-  assert( l==32000 );
-  pic->type = PIX;
-  pic->magic[1] = 'I';
-  return -1 == mf_write(out, pic->bits, 34+l)
-    ? -1
-    : out->len
-    ;
-}
-
-static int save_pix_as(mypix_t * pix, char * path, int type)
-{
-  myfile_t mf;
-  int n;
-
-  assert( path );
-  assert( pix );
-
-  if ( -1 == mf_open(&mf, path, 2))
-    return -1;
-
-  n = (type == PCX)
-    ? save_as_pcx(&mf,pix)
-    : save_as_pix(&mf,pix)
-    ;
-
-  assert( n == mf.len );
-
-  if ( mf_close(&mf) == -1 || n == -1)
-    return -1;
-
-  imsg("output: \"%s\" %dx%dx%d (%s) size:%d\n",
-       path, pix->w, pix->h, 1<<(1<<pix->d),
-       pix->magic, (int)n);
-
-  return 0;
-}
-
-static int save_png_as(mypix_t * pix, char * path)
-{
-  png_structp png_ptr = 0;
-  png_infop info_ptr = 0;
-  png_bytep row;
-  png_byte tmp[160];
-  png_color lut[16];
-  int png_type;
-
-  int ret=-1, y, x;
-  myfile_t mf;
-
-  if (-1 == mf_open(&mf,path,2))
-    goto error;
-
-  png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, 0,0,0);
-  if (!png_ptr)
-    goto png_error;
-
-  if (info_ptr = png_create_info_struct(png_ptr), !info_ptr)
-    goto png_error;
-
-  if (setjmp(png_jmpbuf(png_ptr)))
-    goto png_error;
-
-  png_init_io(png_ptr, mf.file);
-
-  /* Set color #0 to black */
-  lut->red = lut->green = lut->blue = 0;
-
-  assert ( sizeof(lut)/sizeof(*lut) == 16u );
-  assert ( pix->c <= 16 );
-  for ( y = 0; y < pix->c; ++y ) {
-    const uint8_t * const st_lut = &pix->bits[2+(y<<1)];
-    const uint16_t st_rgb = (st_lut[0]<<8) | st_lut[1];
-    lut[y].red	 = col_4to8[15 & (st_rgb>>8)];
-    lut[y].green = col_4to8[15 & (st_rgb>>4)];
-    lut[y].blue	 = col_4to8[15 & (st_rgb>>0)];
-    dmsg("#%X %03X %02X-%02X-%02X\n",
-	 (uint_t)y, (uint_t)st_rgb & 0xFFF,
-	 (uint_t)lut[y].red,(uint_t)lut[y].green,(uint_t) lut[y].blue);
-  }
-
-  /* Skip color #0, fill the rest with White */
-  if ( ! y ) y = 1;
-  for ( ; y < 16; ++y )
-    lut[y].red = lut[y].green = lut[y].blue = 255;
-
-  switch ( pix->magic[2] ) {
-  case '1':
-    assert( pix->w == 320 && pix->h == 200 && pix->d == 2 && pix->c == 16 );
-    png_type = PNG_COLOR_TYPE_PALETTE;
-    png_set_IHDR(png_ptr, info_ptr, pix->w, pix->h,
-		 1<<pix->d, png_type, PNG_INTERLACE_NONE,
-		 PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
-    png_set_PLTE(png_ptr,info_ptr,lut,pix->c);
-    png_write_info(png_ptr, info_ptr);
-
-    for (y=0, row = pix->bits+34; y<200 ; y++, row += 160) {
-      for (x=0; x<320; x += 2)
-	tmp[x >> 1] = ( get_st_pixel(pix,x,y) << 4) | get_st_pixel(pix,x+1,y);
-      png_write_row(png_ptr, tmp);
-    }
-    break;
-
-  case '2':
-    assert( pix->w == 640 && pix->h == 200 && pix->d == 1 && pix->c == 4 );
-    png_type = PNG_COLOR_TYPE_PALETTE;
-    png_set_IHDR(png_ptr, info_ptr, pix->w, pix->h,
-		 1<<pix->d, PNG_COLOR_TYPE_PALETTE, PNG_INTERLACE_NONE,
-		 PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
-    png_set_PLTE(png_ptr,info_ptr,lut,pix->c);
-    png_write_info(png_ptr, info_ptr);
-
-    for (y=0, row = pix->bits+34; y<200 ; y++, row += 160) {
-      for (x=0; x<640; x += 4)
-	tmp[x >> 2] = 0
-	  | ( get_st_pixel(pix,x+0,y) << 6)
-	  | ( get_st_pixel(pix,x+1,y) << 4)
-	  | ( get_st_pixel(pix,x+2,y) << 2)
-	  | ( get_st_pixel(pix,x+3,y) << 0)
-	  ;
-      png_write_row(png_ptr, tmp);
+    if (c == EOF || !c) {
+      (*pbuf)[len] = 0;
+      return len;
     }
-    break;
-
-  case '3':
-    assert( pix->w == 640 && pix->h == 400 && pix->d == 0 && pix->c == 0 );
-    png_type = PNG_COLOR_TYPE_GRAY;
-    png_set_IHDR(png_ptr, info_ptr, pix->w, pix->h,
-		 1, PNG_COLOR_TYPE_GRAY, PNG_INTERLACE_NONE,
-		 PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
-    png_write_info(png_ptr, info_ptr);
-
-    row = pix->bits+34;
-    for (y=0 ; y<400 ; y++, row += 80)
-      png_write_row(png_ptr, row);
-    break;
-
-  default:
-    emsg("internal: Invalid image format -- %s\n",pix->magic);
-    goto error;
-    break;
+    (*pbuf)[len++] = c;
   }
-
-  imsg("output: \"%s\" %dx%dx%d (PNG/%s) size:%d\n",
-       mf.path, pix->w, pix->h,1<<(1<<pix->d),
-       mypng_typestr(png_type),
-       (int) ftell(mf.file));
-
-  png_write_end(png_ptr, 0);
-  ret = 0;
-
-error:
-  mf_close(&mf);
-  if (!info_ptr) png_free_data(png_ptr, info_ptr, PNG_FREE_ALL, -1);
-  if (!png_ptr)	 png_destroy_write_struct(&png_ptr, (png_infopp)0);
-
-  return ret;
-
-png_error:
-  if (errno)
-    syserror(path,"png error");
-  else
-    emsg("libpng error -- %s\n",mf.path);
-  goto error;
 }
 
-int main(int argc, char *argv[])
+/* Convert each input with an automatic output path, then each NUL
+ * separated path read from list ("-" is stdin). Errors do not stop
+ * the batch. Returns the error code of the first failure.
+ */
+static int convert_batch(pngtopi1_ctx * ctx, char ** inputs, int n,
+			 char * list)
 {
-  int ecode = E_OK;
-  char *ipath = 0, *opath = 0;
-  myimg_t *src = 0, *cvt = 0;
-
-  int option_index = 0, c, itype;
-  static char me[] = PROGRAM_NAME;
-
-  argv[0] = me;
-  opterr = 0;				/* Report error */
-  optind = 1;				/* Where arguments start */
-  ecode = E_ARG;
-
-  for (;;) {
-    static const char sopts[] = "hV" "vq" "c:ezr" "d";
-    static struct option lopts[] = {
-      {"help",	  no_argument,	    0, 'h'},
-      {"usage",	  no_argument,	    0, 'h'},
-      {"version", no_argument,	    0, 'V'},
-      /**/
-      {"verbose", no_argument,	    0, 'v'},
-      {"quiet",	  no_argument,	    0, 'q'},
-      /**/
-      {"color",	  required_argument,0, 'c'},
-      {"ste",	  no_argument,	    0, 'e'},
-      {"pcx",	  no_argument,	    0, 'z'},
-      {"pix",	  no_argument,	    0, 'r'},
-      /**/
-      {"same-dir",no_argument,	    0, 'd'},
-      /**/
-      {0, 0, 0, 0}
-    };
-
-    /* getopt_long stores the option index here. */
-
-    c = getopt_long(argc, argv, sopts, lopts, &option_index);
-
-    /* Detect the end of the options. */
-    if (c == -1)
-      break;
-    switch (c)
-    {
-    case 'h': print_usage(opt_bla); ecode = E_OK; goto exit;
-    case 'V': print_version(); ecode = E_OK; goto exit;
-      /**/
-    case 'v': opt_bla++; break;
-    case 'q': opt_bla--; break;
-      /**/
-    case 'c': {
-      int i;
-      static struct { char s[3], m; } modes[] = {
-	{ "3z", CQ_STF|CQ_000 },
-	{ "3r", CQ_STF|CQ_LBR },
-	{ "3f", CQ_STF|CQ_FDR },
-	{ "4z", CQ_STE|CQ_000 },
-	{ "4r", CQ_STE|CQ_LBR },
-	{ "4f", CQ_STE|CQ_FDR },
-      };
-
-      for ( i=0; i<(int)(sizeof(modes)/sizeof(*modes)); ++i )
-	if ( ! strcasecmp(modes[i].s, optarg ) ) {
-	  opt_col = modes[i].m; i = -1; break;
+  int ecode = E_OK, lerr = E_OK, i, cnt = n, max = n+16, bad = 0, len;
+  char ** paths = 0, * line = 0;
+  int * res = 0;
+  size_t lmax = 0;
+  FILE * f = 0;
+
+  /* Gather all the paths first so the workers can share them. */
+  if (paths = mf_malloc(max * sizeof(*paths)), !paths)
+    return E_ERR;
+  memcpy(paths, inputs, n * sizeof(*paths));
+
+  if (list) {
+    f = strcmp(list, "-") ? fopen(list, "rb") : stdin;
+    if (!f) {
+      syserror(list, "open error");
+      lerr = E_ARG;
+    }
+    else {
+      while (len = list_read(f, &line, &lmax), len >= 0) {
+	if (!len)
+	  continue;			/* empty entry */
+	if (cnt == max) {
+	  char ** tmp = realloc(paths, (max *= 2) * sizeof(*paths));
+	  if (!tmp) {
+	    syserror(0, "alloc error");
+	    lerr = E_ERR;
+	    break;
+	  }
+	  paths = tmp;
 	}
-      if (i > 0) {
-	emsg("invalid argument for -c/--color -- `%s'\n",optarg);
-	goto exit;
-      }
-    } break;
-    case 'e': opt_col = CQ_STE|CQ_LBR; break;
-
-    case 'z':
-      if (opt_out == PXX || opt_out == PCX)
-	opt_out = PCX;
-      else {
-	emsg("option `-z' and `-r' are exclusive\n");
-	goto exit;
-      }
-      break;
-
-    case 'r': opt_out = PIX; break;
-      if (opt_out == PXX || opt_out == PIX)
-	opt_out = PIX;
-      else {
-	emsg("option `-z' and `-r' are exclusive\n");
-	goto exit;
+	if (paths[cnt] = mf_strdup(line, 0), !paths[cnt]) {
+	  lerr = E_ERR;
+	  break;
+	}
+	++cnt;
       }
-      break;
-
-      /**/
-    case 'd': opt_dir = 1; break;
-    case 000: break;
-    case '?':
-      if (!opterr) {
-	if (optopt)
-	  emsg("unknown option -- `%c' (%d)\n",
-	       isgraph(optopt)?optopt:'.', optopt);
-	else
-	  emsg("unknown option -- `%s'\n", argv[optind-1]);
+      if (len == -2)
+	lerr = E_ERR;
+      else if (ferror(f)) {
+	syserror(list, "read error");
+	lerr = E_ARG;
       }
-      goto exit;
-      break;
-
-    default:
-      emsg("unexpected option -- `%c' (%d)\n",
-	   isgraph(c)?c:'.', c);
-      ecode = E_INT;
-      goto exit;
     }
   }
 
-  if (optind < argc)
-    ipath = argv[optind++];
-  else {
-    emsg("too few arguments. Try --help.\n");
-    goto exit;
-  }
-
-  if (optind < argc)
-    opath = argv[optind++];
-
-  if (optind < argc) {
-    emsg("too many arguments. Try --help.\n");
+  if (res = mf_calloc((cnt+1) * sizeof(*res)), !res) {
+    ecode = E_ERR;
     goto exit;
   }
-
-  set_color_mode(opt_col);
-
-  /* ----------------------------------------
-     Read the input image file.
-     ---------------------------------------- */
-
-  ecode = E_INP;
-  if (src = read_img_file(ipath), !src)
-    goto exit;
-  itype = src->png.type;
-
-  amsg("Loaded as %dx%dx%d(%d) %s/%s(%d) \"%s\"\n",
-       src->png.w, src->png.h, src->png.d,
-       src->png.c, src->png.magic,
-       type_names[itype&3], itype,
-       src->png.path );
-  assert( !memcmp(src->png.magic, type_names[itype&3], 2) );
-
-  if (itype == PNG) {
-    mypng_t * const png = &src->png;
-
-    assert( !memcmp(src->png.magic,"PNG",3) );
-    imsg("input: \"%s\" %dx%dx%d PNG-%s(%d)\n",
-	 basename(png->path), png->w, png->h, 1<<png->d,
-	 mypng_typestr(png->t), png->t);
-    ecode = E_PNG;
-    if (cvt = mypix_from_png(png), !cvt)
-      goto exit;
-
-  }
-  else {
-    mypix_t * const pix = &src->pix;
-
-    imsg("input: \"%s\" %dx%dx%d (%s)\n",
-	 basename(pix->path), pix->w, pix->h, 1<<pix->d, pix->magic);
-
-    /* Default operation for P[IC][123] is PNG */
-    if (opt_out == PXX)
-      opt_out = PNG;
+  i = -1;
+  if (cnt > 1 && opt_fly)
+    i = convert_pipe(ctx, paths, res, cnt, opt_jobs, opt_fly);
+  else if (cnt > 1 && opt_jobs != 1)
+    i = convert_pool(ctx, paths, res, cnt, opt_jobs);
+  if (i == -1)
+    for (i=0; i<cnt; ++i)
+      res[i] = convert_file(ctx, paths[i], 0);
+
+  for (i=0; i<cnt; ++i)
+    if (res[i]) {
+      ++bad;
+      if (!ecode) ecode = res[i];
+    }
+  if (lerr) {
+    ++bad;
+    if (!ecode) ecode = lerr;
   }
+  imsg("batch: %d file(s), %d error(s)\n", cnt, bad);
 
-  ecode = E_OUT;
-  if ( save_img_as(cvt?cvt:src, opath, opt_out) )
-    goto exit;
-
-  ecode = E_OK;
 exit:
-  myimg_free(&src);
-  myimg_free(&cvt);
-
-  dmsg("%s: exit %d\n",PROGRAM_NAME,ecode);
+  for (i=n; i<cnt; ++i)
+    free(paths[i]);
+  free(paths);
+  free(res);
+  free(line);
+  if (f && f != stdin)
+    fclose(f);
   return ecode;
 }
 
-
 static char *create_output_path(char * ipath, const char * ext)
 {
   const char * ibase = basename(ipath);
@@ -1810,33 +1243,6 @@ static char *create_output_path(char * ipath, const char * ext)
   return opath;
 }
 
-static const char * native_extension(int type, int subtype)
-{
-  switch (type) {
-  case PNG:
-    return ".png";
-  case PIX:
-    switch(subtype) {
-    case '1': return ".pi1";
-    case '2': return ".pi2";
-    case '3': return ".pi3";
-    }
-    break;
-  case PCX:
-    switch(subtype) {
-    case '1': return ".pc1";
-    case '2': return ".pc2";
-    case '3': return ".pc3";
-    }
-    break;
-
-  default:
-    assert( !"unexpected image type" );
-    break;
-  }
-  return "";
-}
-
 static int guess_type_from_path(char * path)
 {
   const char * ext;
@@ -1855,58 +1261,20 @@ static int guess_type_from_path(char * path)
   return PXX;
 }
 
-static int save_img_as(myimg_t * img, char * path, int type)
+/* Warn if the path does not match the output type. Create a path
+ * from the input one if there is none (to be freed).
+ */
+static char * output_path(char * ipath, char * path,
+			  const pngtopi1_out * out)
 {
-  mypix_t * const pix = &img->pix;
-  char * opath;
-  int err = -1, guess_type;
-
-  assert( img );
-  assert( pix->type == PIX || pix->type == PCX );
-
-  dmsg("save_img_as("
-       "%dx%dx%d/%s,"
-       "\"%s\","
-       "%s(%d)\n",
-       pix->w,pix->w,1<<(1<<pix->d),type_names[pix->type],
-       path?path:"(nil)",type_names[type],type);
-
-  guess_type = guess_type_from_path(path);
-  dmsg("guessed type: %s(%d)\n",type_names[guess_type],guess_type);
-
-  if (guess_type != PXX)
-    amsg("provided output suggests %s\n", type_names[guess_type]);
-
-  if ( type == PXX )
-    /* Input was a PNG and no operation was specified. Trying to guess
-     * from filename (if any) or default to PIX. */
-    type = guess_type != PXX ? guess_type : PIX;
+  const int guess_type = guess_type_from_path(path);
 
-  if ( guess_type != PXX && guess_type != type )
+  if ( guess_type != PXX && guess_type != out->type )
       wmsg("provided output (%s) mismatched (%s)\n",
-	   type_names[guess_type], type_names[type]);
-
-  assert( type != PXX );
-  opath = path ? path :
-    create_output_path(pix->path,
-		       native_extension(type, img->pix.magic[2]));
-  if (!opath)
-    return -1;
-
-  if (type == PNG) {
-    if (save_png_as(pix, opath))
-      goto exit;
-  } else {
-    if (save_pix_as(pix, opath, type) )
-      goto exit;
-  }
-
-  err = 0;
-exit:
-  if (opath != path)
-    free(opath);
+	   type_names[guess_type], type_names[out->type]);
 
-  return err;
+  assert( out->type != PXX );
+  return path ? path : create_output_path(ipath, out->ext);
 }
 
 /* ----------------------------------------------------------------------
@@ -1931,6 +1299,7 @@ static void print_usage(int verbose)
 {
   puts(
     "Usage: " PROGRAM_NAME " [OPTIONS] <input> [<output>]\n"
+    "       " PROGRAM_NAME " [OPTIONS] -b <input> ...\n"
     "\n"
     "  PNG/Degas image file converter.\n"
     "\n"
@@ -1947,7 +1316,20 @@ static void print_usage(int verbose)
     " -e --ste            Alias for --color=4r.\n"
     " -z --pcx            Force output as a pc1, pc2 or pc3.\n"
     " -r --pix            Force output as a pi1, pi2 or pi3.\n"
+    " -a --auto-smallest  Output as pc? if smaller than pi? else pi?.\n"
+    " -Z --pcx-optimal    Smallest (slower) RLE encoding for pc1, pc2, pc3.\n"
+    " -p --pcx-palette    Reorder pc1 and pc2 palette for a smaller file.\n"
+    " -k --keep-color0    Same as -p but color #0 stays in place.\n"
+    " -s --png-speed=X    PNG compression: fast, default, small or max.\n"
+    " -m --png-max        Try all PNG compression settings, keep smallest.\n"
+    " -w --png-writer=X   PNG writer: libpng, zlib, fixed or stored.\n"
     " -d --same-dir       Automatic save path includes <input> path.\n"
+    " -n --check          Check <input> can be converted but do not save.\n"
+    " -b --batch          Convert all <input> with automatic <output>.\n"
+    " -L --from-list=FILE Same as -b with NUL separated inputs from FILE.\n"
+    " -j --jobs=N         Batch conversion threads (0: one per CPU).\n"
+    " -A --affinity       Pin each batch thread to a CPU.\n"
+    " -I --in-flight=N    Pipeline batch I/O, at most N images in memory.\n"
     );
   if (!verbose) {
     puts("  Add -v/--verbose prior to -h/--help for details.\n");
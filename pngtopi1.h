@@ -0,0 +1,172 @@
+/**
+ * @file    pngtopi1.h
+ * @author  Benjamin Gerard <https://sourceforge.net/u/benjihan>
+ * @date    2026-10-16
+ * @brief   libpngtopi1: png to p[ci]1/2/3 (and reverse) in memory.
+ */
+
+/*
+  ----------------------------------------------------------------------
+
+  pngtopi1 - a simple png to p[ci]1/2/3 image converter (and reverse)
+  Copyright (C) 2018-2023 Benjamin Gerard
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  ----------------------------------------------------------------------
+*/
+
+#ifndef PNGTOPI1_H
+#define PNGTOPI1_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Error codes (also the pngtopi1 program exit codes) */
+enum {
+  PNGTOPI1_E_OK,			/* success */
+  PNGTOPI1_E_ERR,			/* generic error (memory) */
+  PNGTOPI1_E_ARG,			/* invalid argument */
+  PNGTOPI1_E_INT,			/* internal error */
+  PNGTOPI1_E_INP,			/* input error */
+  PNGTOPI1_E_OUT,			/* output error */
+  PNGTOPI1_E_PNG			/* PNG not convertible to Degas */
+};
+
+/* Image types */
+enum {
+  PNGTOPI1_PXX,				/* automatic */
+  PNGTOPI1_PIX,				/* PI1, PI2 or PI3 */
+  PNGTOPI1_PCX,				/* PC1, PC2 or PC3 (RLE) */
+  PNGTOPI1_PNG
+};
+
+/* Color modes (bit-field): one of STF/STE or'ed with one of
+ * 000/LBR/FDR. 0 is the default (STF|LBR).
+ */
+enum {
+  PNGTOPI1_CQ_STF = 1,			/* 3 bits per component */
+  PNGTOPI1_CQ_STE = 2,			/* 4 bits per component */
+  PNGTOPI1_CQ_000 = 4,			/* 0 fill */
+  PNGTOPI1_CQ_LBR = 8,			/* left bit replication */
+  PNGTOPI1_CQ_FDR = 12			/* full dynamic range */
+};
+
+/* PNG compression presets */
+enum {
+  PNGTOPI1_PZ_DEFAULT, PNGTOPI1_PZ_FAST, PNGTOPI1_PZ_SMALL, PNGTOPI1_PZ_MAX
+};
+
+/* PNG writers */
+enum {
+  PNGTOPI1_PW_LIBPNG, PNGTOPI1_PW_ZLIB, PNGTOPI1_PW_FIXED, PNGTOPI1_PW_STORED
+};
+
+/* Message levels. A message is sent if the verbose option is at
+ * least -1 for errors, 0 for warnings and informations, 1 for
+ * additional and 2 for debug messages.
+ */
+enum {
+  PNGTOPI1_M_ERR, PNGTOPI1_M_WARN, PNGTOPI1_M_INFO,
+  PNGTOPI1_M_MORE, PNGTOPI1_M_DEBUG
+};
+
+/* Message function. msg is a whole line, new-line included. It may
+ * be called by several threads at once if they use their own
+ * contexts.
+ */
+typedef void (*pngtopi1_msg_f)(void * cookie, int level, const char * msg);
+
+typedef struct pngtopi1_opt_s pngtopi1_opt;
+struct pngtopi1_opt_s {
+  int8_t  verbose;			/* message level (see above) */
+  uint8_t col;				/* color mode (PNGTOPI1_CQ_*) */
+  uint8_t out;				/* output type (PNGTOPI1_P??) */
+  uint8_t suggest;			/* PNG input to PXX output type */
+  uint8_t chk;				/* check input only (no output) */
+  uint8_t rle;				/* shortest (not greedy) RLE */
+  uint8_t pal;				/* PC palette order (1:free 2:pin 0) */
+  uint8_t smallest;			/* smallest of PI? and PC? */
+  uint8_t pngz;				/* PNG compression (PNGTOPI1_PZ_*) */
+  uint8_t pngw;				/* PNG writer (PNGTOPI1_PW_*) */
+  pngtopi1_msg_f msg;			/* messages (0: none) */
+  void * cookie;			/* msg first argument */
+};
+
+/* Output of a conversion. */
+typedef struct pngtopi1_out_s pngtopi1_out;
+struct pngtopi1_out_s {
+  void * data;				/* output bytes */
+  size_t len;				/* output size */
+  size_t max;				/* caller buffer size */
+  int type;				/* PIX, PCX, PNG (PXX: none) */
+  int w, h, colors;			/* output image */
+  char format[16];			/* "PI1" ... "PNG/PALETTE" */
+  char ext[8];				/* natural extension ".pi1" ... */
+  char err[256];			/* first error message */
+};
+
+/* Conversion context: options, color tables and scratch of one
+ * conversion at a time. Threads must use their own (a copy of an
+ * initialized context is fine).
+ */
+typedef struct pngtopi1_ctx_s pngtopi1_ctx;
+struct pngtopi1_ctx_s {
+  pngtopi1_opt opt;			/* options */
+  /* private */
+  uint8_t col_4to8[16];			/* X -> XX (color mode) */
+  uint8_t own;				/* output buffer is allocated */
+  char typestr[8];			/* PNG color type name */
+  const char * name;			/* input name (messages) */
+  pngtopi1_out * res;			/* conversion output */
+};
+
+/* Initialize a context.
+ *
+ * @param  ctx  context to initialize
+ * @param  opt  options (0: defaults)
+ * @return PNGTOPI1_E_OK or PNGTOPI1_E_ARG
+ */
+int pngtopi1_init(pngtopi1_ctx * ctx, const pngtopi1_opt * opt);
+
+/* Convert a PNG or Degas image in memory.
+ *
+ * With out->data set the output is written to that buffer of
+ * out->max bytes. If it is too small PNGTOPI1_E_OUT is returned and
+ * out->len is the size needed. Otherwise the output is allocated and
+ * must be released with pngtopi1_free(). Options other than the
+ * color mode can be changed between two conversions.
+ *
+ * @param  ctx   context (pngtopi1_init())
+ * @param  name  input name in messages (0: "<memory>")
+ * @param  data  input image
+ * @param  len   input size
+ * @param  out   output (err is set on error)
+ * @return PNGTOPI1_E_* error code
+ */
+int pngtopi1_convert(pngtopi1_ctx * ctx, const char * name,
+		     const void * data, size_t len, pngtopi1_out * out);
+
+/* Release an output allocated by pngtopi1_convert(). */
+void pngtopi1_free(void * data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PNGTOPI1_H */